@@ -0,0 +1,888 @@
+/*
+ * pisound-midi-bench - MIDI throughput and latency benchmark for Pisound.
+ * Copyright (C) 2026  Vilniaus Blokas UAB, https://blokas.io/pisound/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sound/asound.h>
+
+#define HOMEPAGE_URL "https://blokas.io/pisound/"
+
+enum { PISOUND_MIDI_BENCH_VERSION = 0x0100 };
+
+// The MIDI wire runs at 31250 baud, 10 bits per byte.
+enum { MIDI_BYTES_PER_SECOND      = 3125 };
+enum { MIDI_BYTE_TIME_NS          = 1000000000 / MIDI_BYTES_PER_SECOND };
+
+enum { DEFAULT_THROUGHPUT_BYTES   = 16384 };
+enum { DEFAULT_LATENCY_COUNT      = 1000 };
+enum { DEFAULT_LATENCY_INTERVAL   = 5000 }; // us
+enum { DRAIN_TIMEOUT_MS           = 2000 };
+enum { MAX_SEQUENCE               = 1 << 14 };
+
+enum { HISTOGRAM_BUCKET_US        = 250 };
+enum { HISTOGRAM_BUCKETS          = 40 };
+
+enum test_e
+{
+	T_THROUGHPUT = 1 << 0,
+	T_LATENCY    = 1 << 1,
+	T_ALL        = T_THROUGHPUT | T_LATENCY,
+};
+
+enum format_e
+{
+	F_TEXT = 0,
+	F_CSV,
+	F_JSON,
+};
+
+typedef int64_t timestamp_ns_t;
+
+static timestamp_ns_t get_timestamp_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (timestamp_ns_t)tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
+static void sleep_until_ns(timestamp_ns_t t)
+{
+	struct timespec tp;
+	tp.tv_sec = t / 1000000000ll;
+	tp.tv_nsec = t % 1000000000ll;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tp, NULL) == EINTR)
+		;
+}
+
+struct midi_port_t
+{
+	int               fd;
+	bool              framed;     // Input is delivered in SNDRV_RAWMIDI_MODE_FRAMING_TSTAMP frames.
+	bool              emulated;
+	int               emu_fd;
+	pthread_t         emu_thread;
+	volatile bool     emu_stop;
+};
+
+// Loopback stand-in: echoes everything written to the port back at the MIDI wire rate,
+// as if a cable connected Pisound's MIDI OUT to its MIDI IN.
+static void *emulator_thread(void *arg)
+{
+	struct midi_port_t *port = (struct midi_port_t *)arg;
+	timestamp_ns_t next_slot = 0;
+	uint8_t buffer[256];
+
+	while (!port->emu_stop)
+	{
+		struct pollfd pfd = { port->emu_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 50) <= 0)
+			continue;
+
+		ssize_t n = read(port->emu_fd, buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+
+		for (ssize_t i=0; i<n; ++i)
+		{
+			// Only restart the slot clock after the wire was idle, so sleep overshoot doesn't accumulate.
+			timestamp_ns_t now = get_timestamp_ns();
+			if (next_slot + MIDI_BYTE_TIME_NS < now)
+				next_slot = now;
+			next_slot += MIDI_BYTE_TIME_NS;
+			sleep_until_ns(next_slot);
+
+			if (write(port->emu_fd, &buffer[i], 1) != 1)
+				return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static int find_pisound_device(char *dst, size_t n)
+{
+	FILE *f = fopen("/proc/asound/cards", "rt");
+	if (!f)
+		return -errno;
+
+	char line[256];
+	int card = -1;
+	while (fgets(line, sizeof(line), f))
+	{
+		int c;
+		if (sscanf(line, " %d [", &c) == 1 && strstr(line, "pisound"))
+		{
+			card = c;
+			break;
+		}
+	}
+	fclose(f);
+
+	if (card < 0)
+		return -ENODEV;
+
+	snprintf(dst, n, "/dev/snd/midiC%dD0", card);
+	return 0;
+}
+
+static int resolve_device_path(char *dst, size_t n, const char *device)
+{
+	if (!device)
+		return find_pisound_device(dst, n);
+
+	unsigned int card, dev = 0;
+	if (sscanf(device, "hw:%u,%u", &card, &dev) >= 1)
+	{
+		snprintf(dst, n, "/dev/snd/midiC%uD%u", card, dev);
+		return 0;
+	}
+
+	strncpy(dst, device, n-1);
+	dst[n-1] = '\0';
+	return 0;
+}
+
+static int midi_port_open(struct midi_port_t *port, const char *path)
+{
+	memset(port, 0, sizeof(*port));
+	port->emu_fd = -1;
+
+	port->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (port->fd == -1)
+	{
+		fprintf(stderr, "Failed opening %s! Error %d.\n", path, errno);
+		return -errno;
+	}
+
+	// Ask the kernel to timestamp incoming bytes, so input-to-read latency can be measured.
+	int pversion = SNDRV_RAWMIDI_VERSION;
+	struct snd_rawmidi_params params;
+	memset(&params, 0, sizeof(params));
+	params.stream = SNDRV_RAWMIDI_STREAM_INPUT;
+	params.buffer_size = 4096;
+	params.avail_min = 1;
+	params.mode = SNDRV_RAWMIDI_MODE_FRAMING_TSTAMP | SNDRV_RAWMIDI_MODE_CLOCK_MONOTONIC;
+
+	if (ioctl(port->fd, SNDRV_RAWMIDI_IOCTL_USER_PVERSION, &pversion) == 0 &&
+		ioctl(port->fd, SNDRV_RAWMIDI_IOCTL_PARAMS, &params) == 0)
+	{
+		port->framed = true;
+	}
+	else
+	{
+		fprintf(stderr, "Kernel timestamped MIDI input is unavailable, input-to-read latency won't be measured.\n");
+	}
+
+	return 0;
+}
+
+static int midi_port_open_emulated(struct midi_port_t *port)
+{
+	memset(port, 0, sizeof(*port));
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+		return -errno;
+
+	port->fd = fds[0];
+	port->emu_fd = fds[1];
+	port->emulated = true;
+
+	int err = pthread_create(&port->emu_thread, NULL, emulator_thread, port);
+	if (err != 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return -err;
+	}
+
+	return 0;
+}
+
+static void midi_port_close(struct midi_port_t *port)
+{
+	if (port->emulated)
+	{
+		port->emu_stop = true;
+		pthread_join(port->emu_thread, NULL);
+		close(port->emu_fd);
+	}
+
+	if (port->fd != -1)
+		close(port->fd);
+
+	port->fd = -1;
+}
+
+static int midi_port_write(struct midi_port_t *port, const uint8_t *data, size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t written = write(port->fd, data, n);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data += written;
+		n -= written;
+	}
+	return 0;
+}
+
+static void midi_port_drain(struct midi_port_t *port)
+{
+	if (port->emulated)
+		return;
+
+	int stream = SNDRV_RAWMIDI_STREAM_OUTPUT;
+	ioctl(port->fd, SNDRV_RAWMIDI_IOCTL_DRAIN, &stream);
+}
+
+// Receives the next chunk of input. kernel_ts is set to the kernel's receive timestamp if known, 0 otherwise.
+static ssize_t midi_port_read(struct midi_port_t *port, uint8_t *dst, size_t n, int timeout_ms, timestamp_ns_t *kernel_ts)
+{
+	*kernel_ts = 0;
+
+	struct pollfd pfd = { port->fd, POLLIN, 0 };
+	int result = poll(&pfd, 1, timeout_ms);
+	if (result <= 0)
+		return result;
+
+	if (!port->framed)
+		return read(port->fd, dst, n);
+
+	struct snd_rawmidi_framing_tstamp frame;
+	ssize_t r = read(port->fd, &frame, sizeof(frame));
+	if (r != sizeof(frame))
+		return r < 0 ? r : 0;
+
+	if (frame.frame_type != 0)
+		return 0;
+
+	size_t length = frame.length < n ? frame.length : n;
+	memcpy(dst, frame.data, length);
+	*kernel_ts = (timestamp_ns_t)frame.tv_sec * 1000000000ll + frame.tv_nsec;
+	return length;
+}
+
+struct stats_t
+{
+	size_t count;
+	double min, max, mean, stddev;
+	double p50, p90, p99, p999;
+	unsigned histogram[HISTOGRAM_BUCKETS+1]; // Last bucket holds everything above the range.
+};
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double percentile(const double *sorted, size_t n, double p)
+{
+	double idx = p * (n - 1);
+	size_t lo = (size_t)idx;
+	size_t hi = lo + 1 < n ? lo + 1 : lo;
+	double frac = idx - lo;
+	return sorted[lo] + (sorted[hi] - sorted[lo]) * frac;
+}
+
+// Values are in microseconds. The array gets sorted.
+static void compute_stats(struct stats_t *s, double *values, size_t n)
+{
+	memset(s, 0, sizeof(*s));
+	s->count = n;
+	if (n == 0)
+		return;
+
+	qsort(values, n, sizeof(*values), compare_double);
+
+	double sum = 0.0;
+	for (size_t i=0; i<n; ++i)
+	{
+		sum += values[i];
+		size_t bucket = (size_t)(values[i] / HISTOGRAM_BUCKET_US);
+		++s->histogram[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS];
+	}
+	s->mean = sum / n;
+
+	double var = 0.0;
+	for (size_t i=0; i<n; ++i)
+		var += (values[i] - s->mean) * (values[i] - s->mean);
+	s->stddev = sqrt(var / n);
+
+	s->min  = values[0];
+	s->max  = values[n-1];
+	s->p50  = percentile(values, n, 0.50);
+	s->p90  = percentile(values, n, 0.90);
+	s->p99  = percentile(values, n, 0.99);
+	s->p999 = percentile(values, n, 0.999);
+}
+
+struct results_t
+{
+	unsigned    tests;
+	bool        loopback;
+	bool        emulated;
+	bool        framed;
+
+	// Throughput.
+	size_t      tx_bytes;
+	size_t      rx_bytes;
+	double      tx_seconds;
+	double      rx_seconds;
+	double      tx_rate;
+	double      rx_rate;
+
+	// Latency.
+	size_t          sent;
+	size_t          received;
+	size_t          dropped;
+	size_t          out_of_order;
+	struct stats_t  round_trip;
+	struct stats_t  input_to_read;
+};
+
+static void fill_pattern(uint8_t *dst, size_t n)
+{
+	static const uint8_t msg[6] = { 0x90, 0x3c, 0x40, 0x80, 0x3c, 0x00 };
+	for (size_t i=0; i<n; ++i)
+		dst[i] = msg[i % sizeof(msg)];
+}
+
+static int run_throughput(struct midi_port_t *port, struct results_t *r, size_t bytes, bool loopback)
+{
+	uint8_t *data = malloc(bytes);
+	if (!data)
+		return -ENOMEM;
+	fill_pattern(data, bytes);
+
+	timestamp_ns_t start = get_timestamp_ns();
+	timestamp_ns_t last_rx = start;
+	size_t written = 0;
+	size_t received = 0;
+	int err = 0;
+
+	// Interleave writing and reading so the input side never overflows in loopback.
+	while (written < bytes || (loopback && received < bytes))
+	{
+		if (written < bytes)
+		{
+			size_t chunk = bytes - written < 64 ? bytes - written : 64;
+			err = midi_port_write(port, data + written, chunk);
+			if (err < 0)
+				break;
+			written += chunk;
+		}
+
+		if (loopback)
+		{
+			uint8_t buffer[256];
+			timestamp_ns_t kernel_ts;
+			ssize_t n = midi_port_read(port, buffer, sizeof(buffer), written < bytes ? 0 : DRAIN_TIMEOUT_MS, &kernel_ts);
+			if (n > 0)
+			{
+				received += n;
+				last_rx = get_timestamp_ns();
+			}
+			else if (n < 0 || written == bytes)
+			{
+				break; // Timed out, remaining bytes are counted as dropped.
+			}
+		}
+	}
+
+	midi_port_drain(port);
+	timestamp_ns_t end = get_timestamp_ns();
+
+	r->tx_bytes = written;
+	r->tx_seconds = (end - start) / 1e9;
+	r->tx_rate = r->tx_seconds > 0.0 ? written / r->tx_seconds : 0.0;
+
+	if (loopback)
+	{
+		r->rx_bytes = received;
+		r->rx_seconds = (last_rx - start) / 1e9;
+		r->rx_rate = r->rx_seconds > 0.0 ? received / r->rx_seconds : 0.0;
+	}
+
+	free(data);
+	return err;
+}
+
+static int run_latency(struct midi_port_t *port, struct results_t *r, size_t count, unsigned interval_us)
+{
+	if (count > MAX_SEQUENCE)
+		count = MAX_SEQUENCE;
+
+	timestamp_ns_t *sent_at = calloc(count, sizeof(*sent_at));
+	double *round_trip = calloc(count, sizeof(*round_trip));
+	double *input_to_read = calloc(count, sizeof(*input_to_read));
+	bool *seen = calloc(count, sizeof(*seen));
+
+	if (!sent_at || !round_trip || !input_to_read || !seen)
+	{
+		free(sent_at);
+		free(round_trip);
+		free(input_to_read);
+		free(seen);
+		return -ENOMEM;
+	}
+
+	size_t rt_count = 0, itr_count = 0;
+	size_t next_to_send = 0;
+	size_t expected = 0;
+	uint8_t msg[3];
+	size_t msg_len = 0;
+	timestamp_ns_t next_send = get_timestamp_ns();
+	timestamp_ns_t deadline = 0;
+	int err = 0;
+
+	for (;;)
+	{
+		timestamp_ns_t now = get_timestamp_ns();
+
+		if (next_to_send < count && now >= next_send)
+		{
+			uint8_t note[3] = { 0x90, next_to_send & 0x7f, (next_to_send >> 7) & 0x7f };
+			sent_at[next_to_send] = get_timestamp_ns();
+			err = midi_port_write(port, note, sizeof(note));
+			if (err < 0)
+				break;
+			++next_to_send;
+			next_send += (timestamp_ns_t)interval_us * 1000;
+			if (next_to_send == count)
+				deadline = get_timestamp_ns() + DRAIN_TIMEOUT_MS * 1000000ll;
+			continue;
+		}
+
+		int timeout_ms;
+		if (next_to_send < count)
+			timeout_ms = (int)((next_send - now + 999999) / 1000000);
+		else if (now < deadline && rt_count < count)
+			timeout_ms = (int)((deadline - now + 999999) / 1000000);
+		else
+			break;
+
+		uint8_t buffer[64];
+		timestamp_ns_t kernel_ts;
+		ssize_t n = midi_port_read(port, buffer, sizeof(buffer), timeout_ms, &kernel_ts);
+		timestamp_ns_t read_at = get_timestamp_ns();
+		if (n < 0)
+		{
+			err = -errno;
+			break;
+		}
+
+		for (ssize_t i=0; i<n; ++i)
+		{
+			uint8_t b = buffer[i];
+			if (b >= 0xf8)
+				continue; // Skip realtime messages, such as Active Sensing.
+			if (b & 0x80)
+				msg_len = 0;
+			if (msg_len < sizeof(msg))
+				msg[msg_len++] = b;
+			if (msg_len != sizeof(msg) || msg[0] != 0x90)
+				continue;
+
+			msg_len = 0;
+			size_t seq = msg[1] | (msg[2] << 7);
+			if (seq >= count || seen[seq])
+				continue;
+
+			seen[seq] = true;
+			if (seq != expected)
+				++r->out_of_order;
+			expected = seq + 1;
+
+			round_trip[rt_count++] = (read_at - sent_at[seq]) / 1000.0;
+			if (kernel_ts != 0)
+				input_to_read[itr_count++] = (read_at - kernel_ts) / 1000.0;
+		}
+	}
+
+	r->sent = next_to_send;
+	r->received = rt_count;
+	r->dropped = next_to_send - rt_count;
+	compute_stats(&r->round_trip, round_trip, rt_count);
+	compute_stats(&r->input_to_read, input_to_read, itr_count);
+
+	free(sent_at);
+	free(round_trip);
+	free(input_to_read);
+	free(seen);
+	return err;
+}
+
+static void print_stats_text(FILE *f, const char *name, const struct stats_t *s)
+{
+	if (s->count == 0)
+	{
+		fprintf(f, "%-16s n/a\n", name);
+		return;
+	}
+	fprintf(f, "%-16s min %.1f, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f, stddev (jitter) %.1f us\n",
+		name, s->min, s->mean, s->p50, s->p90, s->p99, s->p999, s->max, s->stddev);
+}
+
+static void print_text(FILE *f, const char *label, const struct results_t *r)
+{
+	fprintf(f, "Label:            %s\n", label);
+	fprintf(f, "Mode:             %s%s\n", r->emulated ? "emulated loopback" : "hardware", r->loopback && !r->emulated ? " loopback" : "");
+	if (r->tests & T_THROUGHPUT)
+	{
+		fprintf(f, "Output:           %zu bytes in %.3f s, %.1f B/s (%.1f%% of %u B/s)\n",
+			r->tx_bytes, r->tx_seconds, r->tx_rate, 100.0 * r->tx_rate / MIDI_BYTES_PER_SECOND, MIDI_BYTES_PER_SECOND);
+		if (r->loopback)
+			fprintf(f, "Input:            %zu bytes in %.3f s, %.1f B/s, %zu dropped\n",
+				r->rx_bytes, r->rx_seconds, r->rx_rate, r->tx_bytes - r->rx_bytes);
+	}
+	if (r->tests & T_LATENCY)
+	{
+		fprintf(f, "Messages:         %zu sent, %zu received, %zu dropped, %zu out of order\n",
+			r->sent, r->received, r->dropped, r->out_of_order);
+		print_stats_text(f, "Round trip:", &r->round_trip);
+		print_stats_text(f, "Input to read:", &r->input_to_read);
+	}
+}
+
+static void print_stats_csv(FILE *f, const char *label, const char *name, const struct stats_t *s)
+{
+	fprintf(f, "%s,%s_count,%zu\n", label, name, s->count);
+	if (s->count == 0)
+		return;
+	fprintf(f, "%s,%s_min_us,%.3f\n", label, name, s->min);
+	fprintf(f, "%s,%s_mean_us,%.3f\n", label, name, s->mean);
+	fprintf(f, "%s,%s_p50_us,%.3f\n", label, name, s->p50);
+	fprintf(f, "%s,%s_p90_us,%.3f\n", label, name, s->p90);
+	fprintf(f, "%s,%s_p99_us,%.3f\n", label, name, s->p99);
+	fprintf(f, "%s,%s_p999_us,%.3f\n", label, name, s->p999);
+	fprintf(f, "%s,%s_max_us,%.3f\n", label, name, s->max);
+	fprintf(f, "%s,%s_stddev_us,%.3f\n", label, name, s->stddev);
+	for (int i=0; i<=HISTOGRAM_BUCKETS; ++i)
+		if (s->histogram[i])
+			fprintf(f, "%s,%s_hist_%u_us,%u\n", label, name, i * HISTOGRAM_BUCKET_US, s->histogram[i]);
+}
+
+static void print_csv(FILE *f, const char *label, const struct results_t *r)
+{
+	fprintf(f, "label,metric,value\n");
+	fprintf(f, "%s,emulated,%d\n", label, r->emulated);
+	fprintf(f, "%s,loopback,%d\n", label, r->loopback);
+	if (r->tests & T_THROUGHPUT)
+	{
+		fprintf(f, "%s,tx_bytes,%zu\n", label, r->tx_bytes);
+		fprintf(f, "%s,tx_seconds,%.6f\n", label, r->tx_seconds);
+		fprintf(f, "%s,tx_bytes_per_second,%.3f\n", label, r->tx_rate);
+		fprintf(f, "%s,tx_wire_utilization,%.4f\n", label, r->tx_rate / MIDI_BYTES_PER_SECOND);
+		if (r->loopback)
+		{
+			fprintf(f, "%s,rx_bytes,%zu\n", label, r->rx_bytes);
+			fprintf(f, "%s,rx_seconds,%.6f\n", label, r->rx_seconds);
+			fprintf(f, "%s,rx_bytes_per_second,%.3f\n", label, r->rx_rate);
+			fprintf(f, "%s,rx_dropped_bytes,%zu\n", label, r->tx_bytes - r->rx_bytes);
+		}
+	}
+	if (r->tests & T_LATENCY)
+	{
+		fprintf(f, "%s,messages_sent,%zu\n", label, r->sent);
+		fprintf(f, "%s,messages_received,%zu\n", label, r->received);
+		fprintf(f, "%s,messages_dropped,%zu\n", label, r->dropped);
+		fprintf(f, "%s,messages_out_of_order,%zu\n", label, r->out_of_order);
+		print_stats_csv(f, label, "round_trip", &r->round_trip);
+		print_stats_csv(f, label, "input_to_read", &r->input_to_read);
+	}
+}
+
+static void print_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; ++s)
+	{
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void print_stats_json(FILE *f, const char *name, const struct stats_t *s, bool last)
+{
+	fprintf(f, "\t\t\"%s\": {\n\t\t\t\"count\": %zu", name, s->count);
+	if (s->count != 0)
+	{
+		fprintf(f, ",\n\t\t\t\"min_us\": %.3f,\n\t\t\t\"mean_us\": %.3f,\n\t\t\t\"p50_us\": %.3f,\n\t\t\t\"p90_us\": %.3f,\n"
+			"\t\t\t\"p99_us\": %.3f,\n\t\t\t\"p999_us\": %.3f,\n\t\t\t\"max_us\": %.3f,\n\t\t\t\"stddev_us\": %.3f,\n",
+			s->min, s->mean, s->p50, s->p90, s->p99, s->p999, s->max, s->stddev);
+		fprintf(f, "\t\t\t\"histogram_bucket_us\": %u,\n\t\t\t\"histogram\": [", HISTOGRAM_BUCKET_US);
+		for (int i=0; i<=HISTOGRAM_BUCKETS; ++i)
+			fprintf(f, "%s%u", i ? ", " : "", s->histogram[i]);
+		fprintf(f, "]");
+	}
+	fprintf(f, "\n\t\t}%s\n", last ? "" : ",");
+}
+
+static void print_json(FILE *f, const char *label, const struct results_t *r)
+{
+	fprintf(f, "{\n\t\"label\": ");
+	print_json_string(f, label);
+	fprintf(f, ",\n\t\"emulated\": %s,\n\t\"loopback\": %s", r->emulated ? "true" : "false", r->loopback ? "true" : "false");
+	if (r->tests & T_THROUGHPUT)
+	{
+		fprintf(f, ",\n\t\"throughput\": {\n\t\t\"wire_bytes_per_second\": %u,\n", MIDI_BYTES_PER_SECOND);
+		fprintf(f, "\t\t\"tx_bytes\": %zu,\n\t\t\"tx_seconds\": %.6f,\n\t\t\"tx_bytes_per_second\": %.3f",
+			r->tx_bytes, r->tx_seconds, r->tx_rate);
+		if (r->loopback)
+			fprintf(f, ",\n\t\t\"rx_bytes\": %zu,\n\t\t\"rx_seconds\": %.6f,\n\t\t\"rx_bytes_per_second\": %.3f,\n\t\t\"rx_dropped_bytes\": %zu",
+				r->rx_bytes, r->rx_seconds, r->rx_rate, r->tx_bytes - r->rx_bytes);
+		fprintf(f, "\n\t}");
+	}
+	if (r->tests & T_LATENCY)
+	{
+		fprintf(f, ",\n\t\"latency\": {\n\t\t\"sent\": %zu,\n\t\t\"received\": %zu,\n\t\t\"dropped\": %zu,\n\t\t\"out_of_order\": %zu,\n",
+			r->sent, r->received, r->dropped, r->out_of_order);
+		print_stats_json(f, "round_trip", &r->round_trip, false);
+		print_stats_json(f, "input_to_read", &r->input_to_read, true);
+		fprintf(f, "\t}");
+	}
+	fprintf(f, "\n}\n");
+}
+
+static void print_version(void)
+{
+	printf("Version %x.%02x, (c) Blokas, " HOMEPAGE_URL "\n", PISOUND_MIDI_BENCH_VERSION >> 8, PISOUND_MIDI_BENCH_VERSION & 0xff);
+}
+
+static void print_usage(void)
+{
+	printf("Usage: pisound-midi-bench [options]\n"
+		"Options:\n"
+		"\t--help                   Display the usage information.\n"
+		"\t--version                Show the version information.\n"
+		"\t--device <dev>           Raw MIDI device to use, either a path or hw:<card>[,<device>]. Default is the first Pisound found.\n"
+		"\t--loopback               Pisound's MIDI OUT is cabled to its MIDI IN, enables input and round trip measurements.\n"
+		"\t--emulate                Use a built-in loopback stand-in running at the MIDI wire rate instead of a device.\n"
+		"\t--test <name>            One of throughput, latency or all. Default is all.\n"
+		"\t--bytes <n>              Amount of bytes to send in the throughput test. Default is %u.\n"
+		"\t--count <n>              Amount of messages to send in the latency test (max %u). Default is %u.\n"
+		"\t--interval <us>          Interval between latency test messages. Default is %u.\n"
+		"\t--format <fmt>           Output format: text, csv or json. Default is text.\n"
+		"\t--label <string>         Label identifying the tested driver build in the output.\n"
+		"\t--output <path>          Write results to a file instead of stdout.\n"
+		"\n",
+		DEFAULT_THROUGHPUT_BYTES, MAX_SEQUENCE, DEFAULT_LATENCY_COUNT, DEFAULT_LATENCY_INTERVAL
+		);
+	print_version();
+}
+
+static bool parse_uint(unsigned int *dst, const char *src)
+{
+	char * endPtr;
+	uint32_t x = strtoul(src, &endPtr, 10);
+	if (endPtr == src || *endPtr != '\0')
+	{
+		*dst = 0;
+		return false;
+	}
+	*dst = x;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = NULL;
+	const char *label = "default";
+	const char *output = NULL;
+	bool loopback = false;
+	bool emulate = false;
+	unsigned tests = T_ALL;
+	unsigned bytes = DEFAULT_THROUGHPUT_BYTES;
+	unsigned count = DEFAULT_LATENCY_COUNT;
+	unsigned interval = DEFAULT_LATENCY_INTERVAL;
+	enum format_e format = F_TEXT;
+
+	int i;
+	for (i=1; i<argc; ++i)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i+1] : NULL;
+
+		if (strcmp(arg, "--help") == 0)
+		{
+			print_usage();
+			return 0;
+		}
+		else if (strcmp(arg, "--version") == 0)
+		{
+			print_version();
+			return 0;
+		}
+		else if (strcmp(arg, "--loopback") == 0)
+		{
+			loopback = true;
+			continue;
+		}
+		else if (strcmp(arg, "--emulate") == 0)
+		{
+			emulate = true;
+			loopback = true;
+			continue;
+		}
+
+		if (!value)
+		{
+			printf("Unknown option or missing argument for '%s'!\n", arg);
+			print_usage();
+			return 1;
+		}
+
+		bool ok = true;
+		if (strcmp(arg, "--device") == 0)
+			device = value;
+		else if (strcmp(arg, "--label") == 0)
+			label = value;
+		else if (strcmp(arg, "--output") == 0)
+			output = value;
+		else if (strcmp(arg, "--bytes") == 0)
+			ok = parse_uint(&bytes, value) && bytes > 0;
+		else if (strcmp(arg, "--count") == 0)
+			ok = parse_uint(&count, value) && count > 0;
+		else if (strcmp(arg, "--interval") == 0)
+			ok = parse_uint(&interval, value);
+		else if (strcmp(arg, "--test") == 0)
+		{
+			if (strcmp(value, "throughput") == 0) tests = T_THROUGHPUT;
+			else if (strcmp(value, "latency") == 0) tests = T_LATENCY;
+			else if (strcmp(value, "all") == 0) tests = T_ALL;
+			else ok = false;
+		}
+		else if (strcmp(arg, "--format") == 0)
+		{
+			if (strcmp(value, "text") == 0) format = F_TEXT;
+			else if (strcmp(value, "csv") == 0) format = F_CSV;
+			else if (strcmp(value, "json") == 0) format = F_JSON;
+			else ok = false;
+		}
+		else
+		{
+			printf("Unknown option '%s'.\n", arg);
+			print_usage();
+			return 1;
+		}
+
+		if (!ok)
+		{
+			printf("Failed parsing argument for '%s'!\n", arg);
+			print_usage();
+			return 1;
+		}
+		++i;
+	}
+
+	if ((tests & T_LATENCY) && !loopback)
+	{
+		fprintf(stderr, "Latency test requires --loopback or --emulate, skipping it.\n");
+		tests &= ~T_LATENCY;
+		if (!tests)
+			return 1;
+	}
+
+	struct midi_port_t port;
+	int err;
+	if (emulate)
+	{
+		err = midi_port_open_emulated(&port);
+	}
+	else
+	{
+		char path[256];
+		err = resolve_device_path(path, sizeof(path), device);
+		if (err < 0)
+		{
+			fprintf(stderr, "Pisound MIDI device not found!\n");
+			return 1;
+		}
+		err = midi_port_open(&port, path);
+	}
+
+	if (err < 0)
+	{
+		fprintf(stderr, "Failed opening MIDI port! (%d)\n", err);
+		return 1;
+	}
+
+	struct results_t results;
+	memset(&results, 0, sizeof(results));
+	results.tests = tests;
+	results.loopback = loopback;
+	results.emulated = emulate;
+	results.framed = port.framed;
+
+	if (tests & T_THROUGHPUT)
+		err = run_throughput(&port, &results, bytes, loopback);
+	if (err == 0 && (tests & T_LATENCY))
+		err = run_latency(&port, &results, count, interval);
+
+	midi_port_close(&port);
+
+	if (err < 0)
+	{
+		fprintf(stderr, "Benchmark failed! (%d)\n", err);
+		return 1;
+	}
+
+	FILE *f = output ? fopen(output, "wt") : stdout;
+	if (!f)
+	{
+		fprintf(stderr, "Failed opening %s! Error %d.\n", output, errno);
+		return 1;
+	}
+
+	switch (format)
+	{
+	case F_TEXT: print_text(f, label, &results); break;
+	case F_CSV:  print_csv(f, label, &results);  break;
+	case F_JSON: print_json(f, label, &results); break;
+	}
+
+	if (f != stdout)
+		fclose(f);
+
+	return 0;
+}
@@ -0,0 +1,879 @@
+/*
+ * pisound-spi-replay - Offline analysis and replay of Pisound SPI frame captures.
+ * Copyright (C) 2026  Vilniaus Blokas UAB, https://blokas.io/pisound/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#define HOMEPAGE_URL "https://blokas.io/pisound/"
+
+enum { PISOUND_SPI_REPLAY_VERSION = 0x0100 };
+
+// The MIDI wire runs at 31250 baud, 10 bits per byte.
+enum { MIDI_BYTES_PER_SECOND      = 3125 };
+enum { MIDI_BYTE_TIME_NS          = 1000000000 / MIDI_BYTES_PER_SECOND };
+
+// Size of the firmware's MIDI output buffer, as assumed by the driver's pacing.
+enum { FIRMWARE_OUTPUT_BUFFER     = 127 };
+
+enum { DEFAULT_STALL_MS           = 10 };
+enum { DEFAULT_TRANSFER_US        = 50 };
+
+// Credit flow control, see pisnd_enable_credits in the driver.
+enum { TX_ENABLE_CREDITS          = 0xc001 };
+enum { RX_CREDITS                 = 0xc0 };
+
+enum format_e
+{
+	F_TEXT = 0,
+	F_CSV,
+	F_JSON,
+};
+
+enum direction_e
+{
+	D_IN = 0,
+	D_OUT,
+};
+
+typedef int64_t timestamp_ns_t;
+
+// One line of /sys/kernel/debug/pisound/capture.
+struct frame_t
+{
+	timestamp_ns_t ns;
+	uint32_t       transfer;
+	uint8_t        tx[2];
+	uint8_t        rx[2];
+	bool           credits; // rx carries a credit report rather than an input byte.
+};
+
+struct capture_t
+{
+	struct frame_t *frames;
+	size_t          count;
+	size_t          capacity;
+};
+
+static timestamp_ns_t get_timestamp_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (timestamp_ns_t)tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
+static void sleep_until_ns(timestamp_ns_t t)
+{
+	struct timespec tp;
+	tp.tv_sec = t / 1000000000ll;
+	tp.tv_nsec = t % 1000000000ll;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tp, NULL) == EINTR)
+		;
+}
+
+static int capture_load(struct capture_t *c, const char *path)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rt");
+	if (!f)
+	{
+		fprintf(stderr, "Failed opening %s! Error %d.\n", path, errno);
+		return -errno;
+	}
+
+	memset(c, 0, sizeof(*c));
+
+	char line[128];
+	unsigned line_no = 0;
+	int err = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		++line_no;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		unsigned long long ns;
+		unsigned transfer, tx, rx;
+		if (sscanf(line, "%llu %u %4x %4x", &ns, &transfer, &tx, &rx) != 4)
+		{
+			fprintf(stderr, "%s:%u: Malformed capture line!\n", path, line_no);
+			err = -EINVAL;
+			break;
+		}
+
+		if (c->count == c->capacity)
+		{
+			size_t capacity = c->capacity ? c->capacity * 2 : 4096;
+			struct frame_t *frames = realloc(c->frames, capacity * sizeof(*frames));
+			if (!frames)
+			{
+				err = -ENOMEM;
+				break;
+			}
+			c->frames = frames;
+			c->capacity = capacity;
+		}
+
+		struct frame_t *frame = &c->frames[c->count++];
+		frame->ns = (timestamp_ns_t)ns;
+		frame->transfer = transfer;
+		frame->tx[0] = tx >> 8;
+		frame->tx[1] = tx & 0xff;
+		frame->rx[0] = rx >> 8;
+		frame->rx[1] = rx & 0xff;
+	}
+
+	if (f != stdin)
+		fclose(f);
+
+	// The firmware starts reporting credits once the driver has enabled them.
+	bool credits = false;
+	for (size_t i=0; i<c->count; ++i)
+	{
+		struct frame_t *frame = &c->frames[i];
+		frame->credits = credits && frame->rx[0] == RX_CREDITS;
+		if (((frame->tx[0] << 8) | frame->tx[1]) == TX_ENABLE_CREDITS)
+			credits = true;
+	}
+
+	return err;
+}
+
+static void capture_free(struct capture_t *c)
+{
+	free(c->frames);
+	memset(c, 0, sizeof(*c));
+}
+
+static inline bool frame_has_out(const struct frame_t *frame)
+{
+	return frame->tx[0] == 0x0f;
+}
+
+static inline bool frame_has_led(const struct frame_t *frame)
+{
+	return frame->tx[0] == 0xf0;
+}
+
+static inline bool frame_has_in(const struct frame_t *frame)
+{
+	return frame->rx[0] != 0 && !frame->credits;
+}
+
+// Minimal MIDI stream checker, counts messages and flags bytes that can't be where they are.
+struct midi_parser_t
+{
+	uint8_t  running_status;
+	unsigned expected;
+	unsigned have;
+	bool     in_sysex;
+
+	size_t   messages;
+	size_t   sysex_messages;
+	size_t   realtime;
+	size_t   stray_data;
+	size_t   broken_sysex;
+};
+
+static unsigned midi_data_length(uint8_t status)
+{
+	switch (status & 0xf0)
+	{
+	case 0x80: case 0x90: case 0xa0: case 0xb0: case 0xe0:
+		return 2;
+	case 0xc0: case 0xd0:
+		return 1;
+	}
+	switch (status)
+	{
+	case 0xf1: case 0xf3:
+		return 1;
+	case 0xf2:
+		return 2;
+	}
+	return 0;
+}
+
+static void midi_parse(struct midi_parser_t *p, uint8_t byte)
+{
+	if (byte >= 0xf8)
+	{
+		++p->realtime;
+		return;
+	}
+
+	if (byte & 0x80)
+	{
+		if (p->in_sysex)
+		{
+			p->in_sysex = false;
+			if (byte == 0xf7)
+			{
+				++p->sysex_messages;
+				return;
+			}
+			++p->broken_sysex;
+		}
+		else if (byte == 0xf7)
+		{
+			++p->stray_data;
+			return;
+		}
+
+		if (byte == 0xf0)
+		{
+			p->in_sysex = true;
+			p->running_status = 0;
+			return;
+		}
+
+		// System common messages don't set a running status, theirs is cleared once complete.
+		p->have = 0;
+		p->expected = midi_data_length(byte);
+		p->running_status = byte;
+		if (p->expected == 0)
+		{
+			++p->messages;
+			p->running_status = 0;
+		}
+		return;
+	}
+
+	if (p->in_sysex)
+		return;
+
+	if (p->running_status == 0)
+	{
+		++p->stray_data;
+		return;
+	}
+
+	if (++p->have == p->expected)
+	{
+		++p->messages;
+		p->have = 0;
+		if (p->running_status >= 0xf0)
+			p->running_status = 0;
+	}
+}
+
+// The captured output run through a model of the driver's pacing against an emulated firmware.
+struct emulation_t
+{
+	size_t         transfers;
+	size_t         idle_transfers;
+	size_t         overflows;
+	double         seconds;
+};
+
+struct results_t
+{
+	size_t         frames;
+	size_t         transfers;
+	size_t         idle_frames;
+	size_t         out_bytes;
+	size_t         in_bytes;
+	size_t         led_flashes;
+	double         seconds;
+	double         out_rate;
+	double         in_rate;
+
+	double         max_gap_us;
+	double         mean_gap_us;
+	size_t         stalls;
+	unsigned       stall_ms;
+
+	// Output bytes run through an emulated UART draining at the wire rate.
+	size_t         max_backlog;
+	size_t         overflows;
+	double         wire_seconds;
+
+	// Credits reported by the firmware, checked against the driver and the emulated UART.
+	size_t         credit_reports;
+	size_t         credit_overruns;
+	size_t         max_credit_drift;
+
+	struct emulation_t estimate;
+	struct emulation_t credits;
+
+	struct midi_parser_t out;
+	struct midi_parser_t in;
+};
+
+static void analyze(const struct capture_t *c, struct results_t *r, unsigned stall_ms)
+{
+	memset(r, 0, sizeof(*r));
+	r->stall_ms = stall_ms;
+
+	if (c->count == 0)
+		return;
+
+	timestamp_ns_t first = c->frames[0].ns;
+	timestamp_ns_t last = c->frames[c->count-1].ns;
+
+	timestamp_ns_t prev_ns = 0;
+	uint32_t prev_transfer = 0;
+	bool prev_had_data = false;
+	bool had_data = false;
+	double gap_sum = 0.0;
+	size_t gaps = 0;
+
+	timestamp_ns_t wire_free_at = 0;
+	timestamp_ns_t wire_first = 0;
+
+	int credits = -1;
+
+	for (size_t i=0; i<c->count; ++i)
+	{
+		const struct frame_t *frame = &c->frames[i];
+
+		if (i == 0 || frame->transfer != prev_transfer)
+		{
+			if (i != 0)
+			{
+				double gap_us = (frame->ns - prev_ns) / 1000.0;
+				gap_sum += gap_us;
+				++gaps;
+				if (gap_us > r->max_gap_us)
+					r->max_gap_us = gap_us;
+
+				// A long pause right after a transfer that moved data suggests the worker stalled mid-stream.
+				if (prev_had_data && gap_us >= stall_ms * 1000.0)
+					++r->stalls;
+			}
+			prev_had_data = had_data;
+			had_data = false;
+			prev_transfer = frame->transfer;
+			prev_ns = frame->ns;
+			++r->transfers;
+		}
+
+		++r->frames;
+
+		if (frame->credits)
+		{
+			// The report doesn't account for the bytes sent in this and the following frames of the transfer,
+			// this frame's byte is taken off below.
+			int later = 0;
+			for (size_t j=i+1; j<c->count && c->frames[j].transfer == frame->transfer; ++j)
+				if (frame_has_out(&c->frames[j]))
+					++later;
+			credits = frame->rx[1] > later ? frame->rx[1] - later : 0;
+			++r->credit_reports;
+
+			size_t backlog = wire_free_at > frame->ns ? (size_t)((wire_free_at - frame->ns + MIDI_BYTE_TIME_NS - 1) / MIDI_BYTE_TIME_NS) : 0;
+			size_t emulated_free = backlog < FIRMWARE_OUTPUT_BUFFER ? FIRMWARE_OUTPUT_BUFFER - backlog : 0;
+			size_t drift = emulated_free > frame->rx[1] ? emulated_free - frame->rx[1] : frame->rx[1] - emulated_free;
+			if (drift > r->max_credit_drift)
+				r->max_credit_drift = drift;
+		}
+
+		if (frame_has_out(frame))
+		{
+			if (credits == 0)
+				++r->credit_overruns;
+			else if (credits > 0)
+				--credits;
+
+			++r->out_bytes;
+			midi_parse(&r->out, frame->tx[1]);
+			had_data = true;
+
+			if (wire_free_at < frame->ns)
+				wire_free_at = frame->ns;
+			if (wire_first == 0)
+				wire_first = frame->ns;
+			wire_free_at += MIDI_BYTE_TIME_NS;
+
+			size_t backlog = (size_t)((wire_free_at - frame->ns + MIDI_BYTE_TIME_NS - 1) / MIDI_BYTE_TIME_NS);
+			if (backlog > r->max_backlog)
+				r->max_backlog = backlog;
+			if (backlog > FIRMWARE_OUTPUT_BUFFER)
+				++r->overflows;
+		}
+		else if (frame_has_led(frame))
+		{
+			++r->led_flashes;
+		}
+
+		if (frame_has_in(frame))
+		{
+			++r->in_bytes;
+			midi_parse(&r->in, frame->rx[1]);
+			had_data = true;
+		}
+
+		if (!frame_has_out(frame) && !frame_has_led(frame) && !frame_has_in(frame))
+			++r->idle_frames;
+	}
+
+	r->seconds = (last - first) / 1e9;
+	if (r->seconds > 0.0)
+	{
+		r->out_rate = r->out_bytes / r->seconds;
+		r->in_rate = r->in_bytes / r->seconds;
+	}
+	if (gaps)
+		r->mean_gap_us = gap_sum / gaps;
+	if (wire_first)
+		r->wire_seconds = (wire_free_at - wire_first) / 1e9;
+}
+
+// Each captured output byte is taken to be ready at the time it was sent. The driver does 2 frame transfers every
+// transfer_ns and the firmware's UART drains at uart_rate, which may differ from the nominal rate the estimate uses.
+static void emulate(const struct capture_t *c, bool credits, unsigned uart_rate, timestamp_ns_t transfer_ns, struct emulation_t *e)
+{
+	memset(e, 0, sizeof(*e));
+
+	size_t n = 0;
+	for (size_t i=0; i<c->count; ++i)
+		if (frame_has_out(&c->frames[i]))
+			++n;
+
+	if (n == 0)
+		return;
+
+	timestamp_ns_t *ready_at = malloc(n * sizeof(*ready_at));
+	if (!ready_at)
+		return;
+
+	n = 0;
+	for (size_t i=0; i<c->count; ++i)
+		if (frame_has_out(&c->frames[i]))
+			ready_at[n++] = c->frames[i].ns;
+
+	double level = 0.0;     // Bytes in the firmware's buffer.
+	int used_millibytes = 0; // The driver's estimate of the above.
+	double overflowed = 0.0;
+	int credit = 0;
+	size_t ready = 0, sent = 0;
+	timestamp_ns_t t = ready_at[0];
+	timestamp_ns_t last = t;
+
+	while (sent < n)
+	{
+		double dt = (double)(t - last);
+		level -= dt * uart_rate / 1e9;
+		if (level < 0.0)
+			level = 0.0;
+		used_millibytes -= (int)(dt * MIDI_BYTES_PER_SECOND / 1e6);
+		if (used_millibytes < 0)
+			used_millibytes = 0;
+		last = t;
+
+		while (ready < n && ready_at[ready] <= t)
+			++ready;
+
+		// The worker goes idle once it has nothing to send and, if estimating, the buffer is deemed empty.
+		if (ready == sent && (credits || used_millibytes == 0))
+		{
+			t = ready_at[ready];
+			continue;
+		}
+
+		int room = credits ? credit : (FIRMWARE_OUTPUT_BUFFER * 1000 - used_millibytes - 1) / 1000;
+		int k = 0;
+		while (k < 2 && sent < ready && k < room)
+		{
+			++sent;
+			++k;
+		}
+
+		if (credits)
+		{
+			int report = FIRMWARE_OUTPUT_BUFFER - (int)(level + 0.999);
+			credit = report > k ? report - k : 0;
+		}
+		else
+		{
+			used_millibytes += k * 1000;
+		}
+
+		level += k;
+		if (level > FIRMWARE_OUTPUT_BUFFER)
+		{
+			overflowed += level - FIRMWARE_OUTPUT_BUFFER;
+			level = FIRMWARE_OUTPUT_BUFFER;
+		}
+
+		++e->transfers;
+		if (k == 0)
+			++e->idle_transfers;
+		t += transfer_ns;
+	}
+
+	e->overflows = (size_t)(overflowed + 0.5);
+	e->seconds = (t - ready_at[0] + level * 1e9 / uart_rate) / 1e9;
+	free(ready_at);
+}
+
+// Writes the captured bytes of one direction to a raw MIDI port with the original timing.
+static int replay(const struct capture_t *c, const char *path, enum direction_e direction, double speed)
+{
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Failed opening %s! Error %d.\n", path, errno);
+		return -errno;
+	}
+
+	timestamp_ns_t start = get_timestamp_ns();
+	timestamp_ns_t first = c->count ? c->frames[0].ns : 0;
+	size_t written = 0;
+	int err = 0;
+
+	for (size_t i=0; i<c->count && err == 0; ++i)
+	{
+		const struct frame_t *frame = &c->frames[i];
+
+		uint8_t byte;
+		if (direction == D_OUT && frame_has_out(frame))
+			byte = frame->tx[1];
+		else if (direction == D_IN && frame_has_in(frame))
+			byte = frame->rx[1];
+		else
+			continue;
+
+		sleep_until_ns(start + (timestamp_ns_t)((frame->ns - first) / speed));
+
+		while (write(fd, &byte, 1) != 1)
+		{
+			if (errno != EINTR)
+			{
+				fprintf(stderr, "Failed writing to %s! Error %d.\n", path, errno);
+				err = -errno;
+				break;
+			}
+		}
+		++written;
+	}
+
+	close(fd);
+
+	if (err == 0)
+		fprintf(stderr, "Replayed %zu bytes in %.3f s.\n", written, (get_timestamp_ns() - start) / 1e9);
+
+	return err;
+}
+
+static void print_parser_text(FILE *f, const char *name, const struct midi_parser_t *p)
+{
+	fprintf(f, "%-18s%zu messages, %zu SysEx, %zu realtime, %zu stray data bytes, %zu broken SysEx\n",
+		name, p->messages, p->sysex_messages, p->realtime, p->stray_data, p->broken_sysex);
+}
+
+static void print_emulation_text(FILE *f, const char *name, const struct emulation_t *e)
+{
+	fprintf(f, "%-18s%.3f s, %zu transfers, %zu idle, %zu bytes overflowed\n",
+		name, e->seconds, e->transfers, e->idle_transfers, e->overflows);
+}
+
+static void print_text(FILE *f, const char *label, const struct results_t *r)
+{
+	fprintf(f, "Label:            %s\n", label);
+	fprintf(f, "Capture:          %zu frames in %zu transfers over %.3f s, %zu idle frames (%.1f%%)\n",
+		r->frames, r->transfers, r->seconds, r->idle_frames, r->frames ? 100.0 * r->idle_frames / r->frames : 0.0);
+	fprintf(f, "Output:           %zu bytes, %.1f B/s (%.1f%% of %u B/s), %zu LED flashes\n",
+		r->out_bytes, r->out_rate, 100.0 * r->out_rate / MIDI_BYTES_PER_SECOND, MIDI_BYTES_PER_SECOND, r->led_flashes);
+	fprintf(f, "Input:            %zu bytes, %.1f B/s\n", r->in_bytes, r->in_rate);
+	fprintf(f, "Transfer gaps:    mean %.1f, max %.1f us, %zu stalls over %u ms\n",
+		r->mean_gap_us, r->max_gap_us, r->stalls, r->stall_ms);
+	fprintf(f, "Emulated UART:    %.3f s on the wire, max backlog %zu bytes, %zu bytes over the %u byte buffer\n",
+		r->wire_seconds, r->max_backlog, r->overflows, FIRMWARE_OUTPUT_BUFFER);
+	fprintf(f, "Credit reports:   %zu, %zu bytes sent without credit, max %zu bytes off the emulated UART\n",
+		r->credit_reports, r->credit_overruns, r->max_credit_drift);
+	print_emulation_text(f, "Emulated estimate:", &r->estimate);
+	print_emulation_text(f, "Emulated credits:", &r->credits);
+	print_parser_text(f, "Output stream:", &r->out);
+	print_parser_text(f, "Input stream:", &r->in);
+}
+
+static void print_parser_csv(FILE *f, const char *label, const char *name, const struct midi_parser_t *p)
+{
+	fprintf(f, "%s,%s_messages,%zu\n", label, name, p->messages);
+	fprintf(f, "%s,%s_sysex_messages,%zu\n", label, name, p->sysex_messages);
+	fprintf(f, "%s,%s_realtime,%zu\n", label, name, p->realtime);
+	fprintf(f, "%s,%s_stray_data,%zu\n", label, name, p->stray_data);
+	fprintf(f, "%s,%s_broken_sysex,%zu\n", label, name, p->broken_sysex);
+}
+
+static void print_emulation_csv(FILE *f, const char *label, const char *name, const struct emulation_t *e)
+{
+	fprintf(f, "%s,%s_seconds,%.6f\n", label, name, e->seconds);
+	fprintf(f, "%s,%s_transfers,%zu\n", label, name, e->transfers);
+	fprintf(f, "%s,%s_idle_transfers,%zu\n", label, name, e->idle_transfers);
+	fprintf(f, "%s,%s_overflows,%zu\n", label, name, e->overflows);
+}
+
+static void print_csv(FILE *f, const char *label, const struct results_t *r)
+{
+	fprintf(f, "label,metric,value\n");
+	fprintf(f, "%s,frames,%zu\n", label, r->frames);
+	fprintf(f, "%s,transfers,%zu\n", label, r->transfers);
+	fprintf(f, "%s,idle_frames,%zu\n", label, r->idle_frames);
+	fprintf(f, "%s,seconds,%.6f\n", label, r->seconds);
+	fprintf(f, "%s,out_bytes,%zu\n", label, r->out_bytes);
+	fprintf(f, "%s,out_bytes_per_second,%.3f\n", label, r->out_rate);
+	fprintf(f, "%s,in_bytes,%zu\n", label, r->in_bytes);
+	fprintf(f, "%s,in_bytes_per_second,%.3f\n", label, r->in_rate);
+	fprintf(f, "%s,led_flashes,%zu\n", label, r->led_flashes);
+	fprintf(f, "%s,mean_gap_us,%.3f\n", label, r->mean_gap_us);
+	fprintf(f, "%s,max_gap_us,%.3f\n", label, r->max_gap_us);
+	fprintf(f, "%s,stalls,%zu\n", label, r->stalls);
+	fprintf(f, "%s,wire_seconds,%.6f\n", label, r->wire_seconds);
+	fprintf(f, "%s,max_backlog,%zu\n", label, r->max_backlog);
+	fprintf(f, "%s,overflows,%zu\n", label, r->overflows);
+	fprintf(f, "%s,credit_reports,%zu\n", label, r->credit_reports);
+	fprintf(f, "%s,credit_overruns,%zu\n", label, r->credit_overruns);
+	fprintf(f, "%s,max_credit_drift,%zu\n", label, r->max_credit_drift);
+	print_emulation_csv(f, label, "emulated_estimate", &r->estimate);
+	print_emulation_csv(f, label, "emulated_credits", &r->credits);
+	print_parser_csv(f, label, "out", &r->out);
+	print_parser_csv(f, label, "in", &r->in);
+}
+
+static void print_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; ++s)
+	{
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void print_parser_json(FILE *f, const char *name, const struct midi_parser_t *p, bool last)
+{
+	fprintf(f, "\t\"%s\": {\n\t\t\"messages\": %zu,\n\t\t\"sysex_messages\": %zu,\n\t\t\"realtime\": %zu,\n"
+		"\t\t\"stray_data\": %zu,\n\t\t\"broken_sysex\": %zu\n\t}%s\n",
+		name, p->messages, p->sysex_messages, p->realtime, p->stray_data, p->broken_sysex, last ? "" : ",");
+}
+
+static void print_emulation_json(FILE *f, const char *name, const struct emulation_t *e)
+{
+	fprintf(f, "\t\"%s\": {\n\t\t\"seconds\": %.6f,\n\t\t\"transfers\": %zu,\n\t\t\"idle_transfers\": %zu,\n"
+		"\t\t\"overflows\": %zu\n\t},\n",
+		name, e->seconds, e->transfers, e->idle_transfers, e->overflows);
+}
+
+static void print_json(FILE *f, const char *label, const struct results_t *r)
+{
+	fprintf(f, "{\n\t\"label\": ");
+	print_json_string(f, label);
+	fprintf(f, ",\n\t\"frames\": %zu,\n\t\"transfers\": %zu,\n\t\"idle_frames\": %zu,\n\t\"seconds\": %.6f,\n",
+		r->frames, r->transfers, r->idle_frames, r->seconds);
+	fprintf(f, "\t\"out_bytes\": %zu,\n\t\"out_bytes_per_second\": %.3f,\n\t\"in_bytes\": %zu,\n\t\"in_bytes_per_second\": %.3f,\n",
+		r->out_bytes, r->out_rate, r->in_bytes, r->in_rate);
+	fprintf(f, "\t\"led_flashes\": %zu,\n\t\"mean_gap_us\": %.3f,\n\t\"max_gap_us\": %.3f,\n\t\"stalls\": %zu,\n",
+		r->led_flashes, r->mean_gap_us, r->max_gap_us, r->stalls);
+	fprintf(f, "\t\"wire_seconds\": %.6f,\n\t\"max_backlog\": %zu,\n\t\"overflows\": %zu,\n",
+		r->wire_seconds, r->max_backlog, r->overflows);
+	fprintf(f, "\t\"credit_reports\": %zu,\n\t\"credit_overruns\": %zu,\n\t\"max_credit_drift\": %zu,\n",
+		r->credit_reports, r->credit_overruns, r->max_credit_drift);
+	print_emulation_json(f, "emulated_estimate", &r->estimate);
+	print_emulation_json(f, "emulated_credits", &r->credits);
+	print_parser_json(f, "out", &r->out, false);
+	print_parser_json(f, "in", &r->in, true);
+	fprintf(f, "}\n");
+}
+
+static void print_version(void)
+{
+	printf("Version %x.%02x, (c) Blokas, " HOMEPAGE_URL "\n", PISOUND_SPI_REPLAY_VERSION >> 8, PISOUND_SPI_REPLAY_VERSION & 0xff);
+}
+
+static void print_usage(void)
+{
+	printf("Usage: pisound-spi-replay [options] <capture file or ->\n"
+		"Options:\n"
+		"\t--help                   Display the usage information.\n"
+		"\t--version                Show the version information.\n"
+		"\t--stall <ms>             Gap after a data carrying transfer that counts as a stall. Default is %u.\n"
+		"\t--uart-rate <B/s>        Rate at which the emulated firmware's UART drains. Default is %u.\n"
+		"\t--transfer-us <us>       Time between transfers of the emulated driver. Default is %u.\n"
+		"\t--play <dev>             Replay the captured bytes to a raw MIDI device path with the original timing.\n"
+		"\t--direction <dir>        Direction to replay, in or out. Default is in.\n"
+		"\t--speed <x>              Replay speed factor. Default is 1.\n"
+		"\t--format <fmt>           Output format: text, csv or json. Default is text.\n"
+		"\t--label <string>         Label identifying the capture in the output.\n"
+		"\t--output <path>          Write results to a file instead of stdout.\n"
+		"\n"
+		"Captures are read from /sys/kernel/debug/pisound/capture, with the driver loaded with capture_frames=<n>.\n"
+		"\n",
+		DEFAULT_STALL_MS,
+		MIDI_BYTES_PER_SECOND,
+		DEFAULT_TRANSFER_US
+		);
+	print_version();
+}
+
+static bool parse_uint(unsigned int *dst, const char *src)
+{
+	char * endPtr;
+	uint32_t x = strtoul(src, &endPtr, 10);
+	if (endPtr == src || *endPtr != '\0')
+	{
+		*dst = 0;
+		return false;
+	}
+	*dst = x;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *input = NULL;
+	const char *play = NULL;
+	const char *label = "default";
+	const char *output = NULL;
+	unsigned stall_ms = DEFAULT_STALL_MS;
+	unsigned uart_rate = MIDI_BYTES_PER_SECOND;
+	unsigned transfer_us = DEFAULT_TRANSFER_US;
+	enum direction_e direction = D_IN;
+	double speed = 1.0;
+	enum format_e format = F_TEXT;
+
+	int i;
+	for (i=1; i<argc; ++i)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i+1] : NULL;
+
+		if (strcmp(arg, "--help") == 0)
+		{
+			print_usage();
+			return 0;
+		}
+		else if (strcmp(arg, "--version") == 0)
+		{
+			print_version();
+			return 0;
+		}
+		else if (strncmp(arg, "--", 2) != 0)
+		{
+			input = arg;
+			continue;
+		}
+
+		if (!value)
+		{
+			printf("Unknown option or missing argument for '%s'!\n", arg);
+			print_usage();
+			return 1;
+		}
+
+		bool ok = true;
+		if (strcmp(arg, "--play") == 0)
+			play = value;
+		else if (strcmp(arg, "--label") == 0)
+			label = value;
+		else if (strcmp(arg, "--output") == 0)
+			output = value;
+		else if (strcmp(arg, "--stall") == 0)
+			ok = parse_uint(&stall_ms, value) && stall_ms > 0;
+		else if (strcmp(arg, "--uart-rate") == 0)
+			ok = parse_uint(&uart_rate, value) && uart_rate > 0;
+		else if (strcmp(arg, "--transfer-us") == 0)
+			ok = parse_uint(&transfer_us, value) && transfer_us > 0;
+		else if (strcmp(arg, "--speed") == 0)
+		{
+			char *end;
+			speed = strtod(value, &end);
+			ok = end != value && *end == '\0' && speed > 0.0;
+		}
+		else if (strcmp(arg, "--direction") == 0)
+		{
+			if (strcmp(value, "in") == 0) direction = D_IN;
+			else if (strcmp(value, "out") == 0) direction = D_OUT;
+			else ok = false;
+		}
+		else if (strcmp(arg, "--format") == 0)
+		{
+			if (strcmp(value, "text") == 0) format = F_TEXT;
+			else if (strcmp(value, "csv") == 0) format = F_CSV;
+			else if (strcmp(value, "json") == 0) format = F_JSON;
+			else ok = false;
+		}
+		else
+		{
+			printf("Unknown option '%s'.\n", arg);
+			print_usage();
+			return 1;
+		}
+
+		if (!ok)
+		{
+			printf("Failed parsing argument for '%s'!\n", arg);
+			print_usage();
+			return 1;
+		}
+		++i;
+	}
+
+	if (!input)
+	{
+		print_usage();
+		return 1;
+	}
+
+	struct capture_t capture;
+	if (capture_load(&capture, input) < 0)
+		return 1;
+
+	if (play && replay(&capture, play, direction, speed) < 0)
+	{
+		capture_free(&capture);
+		return 1;
+	}
+
+	struct results_t results;
+	analyze(&capture, &results, stall_ms);
+	emulate(&capture, false, uart_rate, transfer_us * 1000ll, &results.estimate);
+	emulate(&capture, true, uart_rate, transfer_us * 1000ll, &results.credits);
+	capture_free(&capture);
+
+	FILE *f = output ? fopen(output, "wt") : stdout;
+	if (!f)
+	{
+		fprintf(stderr, "Failed opening %s! Error %d.\n", output, errno);
+		return 1;
+	}
+
+	switch (format)
+	{
+	case F_TEXT: print_text(f, label, &results); break;
+	case F_CSV:  print_csv(f, label, &results);  break;
+	case F_JSON: print_json(f, label, &results); break;
+	}
+
+	if (f != stdout)
+		fclose(f);
+
+	return 0;
+}
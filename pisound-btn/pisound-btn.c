@@ -36,6 +36,15 @@
 #include <gpiod.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
 
 #define HOMEPAGE_URL "https://blokas.io/pisound/"
 #define UPDATE_URL   HOMEPAGE_URL "updates/?btnv=%x.%02x&v=%s&sn=%s&id=%s"
@@ -43,7 +52,12 @@
 enum { PISOUND_BTN_VERSION     = 0x0117 };
 enum { INVALID_VERSION         = 0xffff };
 enum { CLICK_TIMEOUT_MS        = 400    };
-enum { HOLD_PRESS_TIMEOUT_MS   = CLICK_TIMEOUT_MS };
+enum { MAX_CLICK_WINDOW_MS     = 5000   };
+enum { HOLD_FEEDBACK_FLASH     = 50     };
+enum { EVENT_BUFFER_SIZE       = 16     };
+enum { DEFAULT_DEBOUNCE_MS     = 10     };
+enum { MAX_DEBOUNCE_MS         = 1000   };
+enum { PISOUND_BUTTON_LINE     = 17     };
 
 #define BASE_PISOUND_DIR "/usr/local/pisound"
 #define BASE_SCRIPTS_DIR BASE_PISOUND_DIR "/scripts/pisound-btn"
@@ -68,6 +82,9 @@ struct gpio_pin_t
 	int               offset;
 	int               events;
 	bool              exported;
+
+	bool              hw_debounce;
+	bool              evdev;       // Read through the Pisound driver's input device rather than the GPIO line.
 };
 
 struct gpiod_chip *g_chip = NULL;
@@ -76,8 +93,16 @@ static struct gpiod_request_config *g_cfg = NULL;
 static struct gpiod_edge_event_buffer *g_event_buffer = NULL;
 #endif
 
-struct gpio_pin_t g_pin;
-static int g_button_pin = 17;
+// The first button uses the plain names in the config, the others have them prefixed, like GPIO27_CLICK_1.
+enum { MAX_BUTTONS = 8 };
+#define BUTTON_PREFIX "GPIO%d_"
+
+static struct gpio_pin_t g_pins[MAX_BUTTONS];
+static unsigned int g_pin_count = 0;
+static int g_button_pins[MAX_BUTTONS] = { PISOUND_BUTTON_LINE };
+static unsigned int g_button_count = 1;
+static bool g_button_pins_specified = false;
+static unsigned int g_debounce_ms = DEFAULT_DEBOUNCE_MS;
 static enum PinActivation g_pin_activation = PA_ACTIVE_LOW;
 static bool g_use_default = true;
 
@@ -102,19 +127,26 @@ static const char *const HOLD_NAME="HOLD_%uS";
 static const char *const HOLD_OTHER_VALUE_NAME     = "HOLD_OTHER";
 
 static const char *const CLICK_COUNT_LIMIT_VALUE_NAME = "CLICK_COUNT_LIMIT";
+static const char *const CLICK_WINDOW_VALUE_NAME      = "CLICK_WINDOW";
 
 static const char *const PISOUND_ID_FILE           = "/sys/kernel/pisound/id";
 static const char *const PISOUND_SERIAL_FILE       = "/sys/kernel/pisound/serial";
 static const char *const PISOUND_VERSION_FILE      = "/sys/kernel/pisound/version";
+static const char *const PISOUND_LED_FILE          = "/sys/kernel/pisound/led";
+static const char *const PISOUND_INPUT_NAME        = "pisound button";
+static const char *const GPIOCHIP_CACHE_DIR        = "/var/cache/pisound-btn";
+static const char *const GPIOCHIP_CACHE_FILE       = "/var/cache/pisound-btn/gpiochip";
 
 static const char *const UPDATE_CHECK_DISABLE_FILE = BASE_PISOUND_DIR "/disable_update_check"; // If the file exists, the update check will be disabled.
-static const char *const DEFAULT_DOWN              = BASE_SCRIPTS_DIR "/system/down.sh";
-static const char *const DEFAULT_UP                = BASE_SCRIPTS_DIR "/system/up.sh";
+static const char *const DEFAULT_DOWN              = "@led-blink";
+static const char *const DEFAULT_DOWN_ARGS         = "10 1000";
+static const char *const DEFAULT_UP                = "@led-stop";
 static const char *const DEFAULT_CLICK_1           = BASE_SCRIPTS_DIR "/start_puredata.sh";
 static const char *const DEFAULT_CLICK_2           = BASE_SCRIPTS_DIR "/stop_puredata.sh";
 static const char *const DEFAULT_CLICK_3           = BASE_SCRIPTS_DIR "/toggle_wifi_hotspot.sh";
 
 // Receive 'held after n clicks' and 'time held' arguments.
+static const char *const DO_NOTHING_SCRIPT         = BASE_SCRIPTS_DIR "/do_nothing.sh";
 static const char *const DEFAULT_HOLD_3S           = BASE_SCRIPTS_DIR "/toggle_bt_discoverable.sh";
 static const char *const DEFAULT_HOLD_5S           = BASE_SCRIPTS_DIR "/shutdown.sh";
 
@@ -123,8 +155,8 @@ enum { MAX_PATH_LENGTH = 4096 };
 
 static char g_config_path[MAX_PATH_LENGTH+1]  = "/etc/pisound.conf";
 
-// must hold the CLICK_OTHER_VALUE_NAME or HOLD_OTHER_VALUE_NAME values
-#define ACTION_NAME_SIZE 11
+// must hold the CLICK_OTHER_VALUE_NAME or HOLD_OTHER_VALUE_NAME values, prefixed with BUTTON_PREFIX
+#define ACTION_NAME_SIZE 23
 // printf( CLICK_%u", ABSOLUTE_MAX_CLICK) must fit in ACTION_NAME_SIZE
 #define ABSOLUTE_MAX_CLICK 99
 // printf( HOLD_%uS", ABSOLUTE_MAX_HOLD) must fit in ACTION_NAME_SIZE
@@ -133,6 +165,9 @@ static char g_config_path[MAX_PATH_LENGTH+1]  = "/etc/pisound.conf";
 #define TICK_2_SECONDS(x) seconds(x)
 
 
+// The hold times seconds() rounds to change only at multiples of this.
+enum { HOLD_ROUNDING_MS = 500 };
+
 static bool g_full_time = false;
 static bool g_offset_time = false;
 
@@ -162,6 +197,18 @@ static int seconds( int ticks ) {
 enum { DEFAULT_CLICK_COUNT_LIMIT = 8 };
 
 static unsigned int g_click_count_limit = DEFAULT_CLICK_COUNT_LIMIT;
+static bool g_click_count_limit_specified = false;
+// How long after a press another one still continues the click sequence, also the shortest hold.
+static unsigned int g_click_window_ms = CLICK_TIMEOUT_MS;
+static bool g_click_window_specified = false;
+
+enum hold_mode_e
+{
+	HM_CROSSING = 0, // A hold action that every longer hold resolves to runs as soon as it's reached, the LEDs flash at the others.
+	HM_RELEASE  = 1, // Hold actions run on release.
+};
+
+static enum hold_mode_e g_hold_mode = HM_CROSSING;
 static unsigned int g_debug = 1;
 
 static void debug( unsigned int level, const char *fmt, ...)
@@ -172,360 +219,1231 @@ static void debug( unsigned int level, const char *fmt, ...)
 		vfprintf(stderr,fmt,argp);
 		va_end(argp);
 	}
-}
+}
+
+
+static bool parse_uint(unsigned int *dst, const char *src)
+{
+	char * endPtr;
+	uint32_t x = strtoul(src, &endPtr, 10);
+	if (endPtr == src || *endPtr != '\0')
+	{
+		*dst = 0;
+		return false;
+	}
+	*dst = x;
+	return true;
+}
+
+typedef unsigned long long timestamp_ms_t;
+
+static timestamp_ms_t timespec_to_ms(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000ull + ts->tv_nsec / 1000000;
+}
+
+static timestamp_ms_t get_timestamp_ms(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return timespec_to_ms(&tp);
+}
+
+// Reads a line, truncates it if needed, seeks to the next line.
+static bool read_line(FILE *f, char *buffer, size_t n)
+{
+	memset(buffer, 0, n);
+
+	if (fgets(buffer, n, f) == NULL)
+		return false;
+
+	if (buffer[n-2] != '\0' && buffer[n-2] != '\n')
+	{
+		// Whole line didn't fit into the buffer, seek until next line.
+		while (!feof(f))
+		{
+			int c = fgetc(f);
+			if (c == '\n')
+				break;
+		}
+	}
+
+	return true;
+}
+
+// Built-in actions, run in-process, given in place of a script path.
+enum verb_e
+{
+	V_EXEC = 0,  // Run the script, or the command given to @start.
+	V_NOP,       // @nop
+	V_LED,       // @led <flash duration>
+	V_LED_BLINK, // @led-blink <flash duration> <period ms>
+	V_LED_STOP,  // @led-stop
+	V_SIGNAL,    // @signal <signal> <process name>, also @stop <process name> for SIGTERM.
+};
+
+struct action_t
+{
+	char name[ACTION_NAME_SIZE+1];
+	enum verb_e verb;
+	unsigned int led_duration;
+	unsigned int period_ms;
+	int signum;
+	char process[16]; // As in /proc/<pid>/comm.
+	char *cmd;      // The script path followed by the configured arguments, NULL if there's nothing to execute.
+	bool has_args;  // If not set, the click count and hold time get appended as arguments.
+	char **argv;    // cmd split into arguments, NULL if it needs /bin/sh to be interpreted.
+	int argc;
+};
+
+// Characters that need a shell to be interpreted, the others are executed directly.
+static const char *const SHELL_CHARS = "|&;<>()$`\\\"'*?[]~={}!\n";
+
+// The parsed configuration, with every (action, click count, hold seconds) combination resolved up front,
+// so dispatching a button event is a table lookup.
+struct config_t
+{
+	struct action_t down;
+	struct action_t up;
+	struct action_t click[ABSOLUTE_MAX_CLICK+1];
+	struct action_t click_other;
+	struct action_t hold[ABSOLUTE_MAX_HOLD+1];
+	struct action_t hold_other;
+
+	// Entries for the built-in defaults, used where the config doesn't specify an action.
+	struct action_t defaults[7];
+	unsigned int defaults_count;
+
+	bool click_count_limit_specified;
+	unsigned int click_count_limit;
+	bool click_window_specified;
+	unsigned int click_window;
+
+	const struct action_t *down_action;
+	const struct action_t *up_action;
+
+	// The last entry of each table is for the counts beyond the absolute maximums.
+	const struct action_t *click_table[ABSOLUTE_MAX_CLICK+2];
+	const struct action_t *hold_table[ABSOLUTE_MAX_HOLD+2];
+
+	// Whether no longer click sequence does anything, so the click can be dispatched on release.
+	bool click_final[ABSOLUTE_MAX_CLICK+2];
+
+	// Hold times in ms at which a hold action different from the previous one takes over, ascending.
+	unsigned int hold_thresholds[ABSOLUTE_MAX_HOLD+2];
+	unsigned int hold_threshold_count;
+	// Whether all the longer holds resolve to the last threshold's action, so it can run without waiting for release.
+	bool hold_last_final;
+};
+
+// One for each button, in the order of g_button_pins.
+static struct config_t *g_configs[MAX_BUTTONS];
+
+static void button_prefix(char *dst, size_t n, unsigned int button)
+{
+	if (button == 0)
+		dst[0] = '\0';
+	else
+		snprintf(dst, n, BUTTON_PREFIX, g_button_pins[button]);
+}
+
+// Matches names like CLICK_12 or HOLD_3S, in the exact form the sprintf'ed names had.
+static bool parse_indexed_name(const char *name, const char *prefix, const char *suffix, unsigned max, unsigned *index)
+{
+	size_t prefix_length = strlen(prefix);
+	size_t suffix_length = strlen(suffix);
+	size_t length = strlen(name);
+
+	if (length <= prefix_length + suffix_length || strncmp(name, prefix, prefix_length) != 0 || strcmp(name + length - suffix_length, suffix) != 0)
+		return false;
+
+	char digits[ACTION_NAME_SIZE+1];
+	size_t n = length - prefix_length - suffix_length;
+	if (n >= sizeof(digits) || (n > 1 && name[prefix_length] == '0'))
+		return false;
+
+	memcpy(digits, name + prefix_length, n);
+	digits[n] = '\0';
+
+	if (strspn(digits, "0123456789") != n)
+		return false;
+
+	return parse_uint(index, digits) && *index <= max;
+}
+
+static struct action_t *config_find_entry(struct config_t *c, const char *name)
+{
+	unsigned index;
+
+	if (strcmp(name, DOWN_VALUE_NAME) == 0)
+		return &c->down;
+	if (strcmp(name, UP_VALUE_NAME) == 0)
+		return &c->up;
+	if (strcmp(name, CLICK_OTHER_VALUE_NAME) == 0)
+		return &c->click_other;
+	if (strcmp(name, HOLD_OTHER_VALUE_NAME) == 0)
+		return &c->hold_other;
+	if (parse_indexed_name(name, "CLICK_", "", ABSOLUTE_MAX_CLICK, &index))
+		return &c->click[index];
+	if (parse_indexed_name(name, "HOLD_", "S", ABSOLUTE_MAX_HOLD, &index))
+		return &c->hold[index];
+
+	return NULL;
+}
+
+// The path is either absolute or relative to the config file location.
+static char *make_command(const char *conf, const char *script, const char *args)
+{
+	char path[MAX_PATH_LENGTH + 1];
+
+	if (script[0] == '/')
+	{
+		strncpy(path, script, sizeof(path)-1);
+		path[sizeof(path)-1] = '\0';
+	}
+	else
+	{
+		strncpy(path, conf, sizeof(path)-1);
+		path[sizeof(path)-1] = '\0';
+		dirname(path);
+		strncat(path, "/", sizeof(path)-1 - strlen(path));
+		strncat(path, script, sizeof(path)-1 - strlen(path));
+	}
+
+	char *cmd = NULL;
+	if (asprintf(&cmd, args[0] ? "%s %s" : "%s%s", path, args) < 0)
+		return NULL;
+
+	return cmd;
+}
+
+static int parse_signal(const char *name)
+{
+	static const struct
+	{
+		const char *name;
+		int signum;
+	} signals[] =
+	{
+		{ "HUP",  SIGHUP  },
+		{ "INT",  SIGINT  },
+		{ "QUIT", SIGQUIT },
+		{ "KILL", SIGKILL },
+		{ "USR1", SIGUSR1 },
+		{ "USR2", SIGUSR2 },
+		{ "TERM", SIGTERM },
+		{ "CONT", SIGCONT },
+		{ "STOP", SIGSTOP },
+	};
+
+	unsigned int x;
+	if (parse_uint(&x, name))
+		return x > 0 && x < NSIG ? (int)x : -1;
+
+	if (strncmp(name, "SIG", 3) == 0)
+		name += 3;
+
+	int i;
+	for (i=0; i<sizeof(signals)/sizeof(*signals); ++i)
+		if (strcmp(name, signals[i].name) == 0)
+			return signals[i].signum;
+
+	return -1;
+}
+
+// Fills in the built-in action, returns false if the verb or its arguments are invalid.
+static bool parse_verb(struct action_t *entry, const char *verb, const char *args)
+{
+	char extra;
+	char signal[16];
+
+	if (strcmp(verb, "@nop") == 0)
+	{
+		entry->verb = V_NOP;
+		return true;
+	}
+	else if (strcmp(verb, "@led") == 0)
+	{
+		entry->verb = V_LED;
+		return sscanf(args, "%u %c", &entry->led_duration, &extra) == 1 && entry->led_duration <= 255;
+	}
+	else if (strcmp(verb, "@led-blink") == 0)
+	{
+		entry->verb = V_LED_BLINK;
+		return sscanf(args, "%u %u %c", &entry->led_duration, &entry->period_ms, &extra) == 2 &&
+			entry->led_duration <= 255 && entry->period_ms > 0;
+	}
+	else if (strcmp(verb, "@led-stop") == 0)
+	{
+		entry->verb = V_LED_STOP;
+		return true;
+	}
+	else if (strcmp(verb, "@signal") == 0)
+	{
+		entry->verb = V_SIGNAL;
+		if (sscanf(args, "%15s %15s %c", signal, entry->process, &extra) != 2)
+			return false;
+		entry->signum = parse_signal(signal);
+		return entry->signum > 0;
+	}
+	else if (strcmp(verb, "@stop") == 0)
+	{
+		entry->verb = V_SIGNAL;
+		entry->signum = SIGTERM;
+		return sscanf(args, "%15s %c", entry->process, &extra) == 1;
+	}
+
+	return false;
+}
+
+static bool config_set_entry(struct action_t *entry, const char *name, const char *conf, const char *script, const char *args)
+{
+	strncpy(entry->name, name, ACTION_NAME_SIZE);
+	entry->name[ACTION_NAME_SIZE] = '\0';
+	entry->has_args = args[0] != '\0';
+	entry->cmd = NULL;
+	entry->verb = V_EXEC;
+
+	if (script[0] == '\0')
+		return true;
+
+	if (strcmp(script, "@start") == 0)
+	{
+		// The command follows, handled just like a script.
+		static const char *WHITESPACE_CHARS = " \t";
+		const char *end = args + strcspn(args, WHITESPACE_CHARS);
+		char path[MAX_PATH_LENGTH + 1];
+		snprintf(path, sizeof(path), "%.*s", (int)(end - args), args);
+		if (path[0] == '\0')
+		{
+			fprintf(stderr, "Missing command for %s!\n", name);
+			entry->verb = V_NOP;
+			return true;
+		}
+		return config_set_entry(entry, name, conf, path, end + strspn(end, WHITESPACE_CHARS));
+	}
+
+	// It's there as a placeholder, so don't even bother starting it.
+	if (strcmp(script, DO_NOTHING_SCRIPT) == 0 && !entry->has_args)
+	{
+		entry->verb = V_NOP;
+		return true;
+	}
+
+	if (script[0] == '@')
+	{
+		if (!parse_verb(entry, script, args))
+		{
+			fprintf(stderr, "Invalid built-in action '%s %s' for %s!\n", script, args, name);
+			entry->verb = V_NOP;
+		}
+		return true;
+	}
+
+	entry->cmd = make_command(conf, script, args);
+	if (!entry->cmd)
+		return false;
+
+	if (strpbrk(entry->cmd, SHELL_CHARS))
+		return true;
+
+	// Split into arguments, leaving room for the click count, hold time and the terminating NULL.
+	char *storage = strdup(entry->cmd);
+	entry->argv = calloc(strlen(entry->cmd) / 2 + 4, sizeof(char *));
+	if (!storage || !entry->argv)
+	{
+		free(storage);
+		free(entry->argv);
+		entry->argv = NULL;
+		return false;
+	}
+
+	char *save = NULL;
+	char *arg = strtok_r(storage, " \t", &save);
+	while (arg)
+	{
+		entry->argv[entry->argc++] = arg;
+		arg = strtok_r(NULL, " \t", &save);
+	}
+
+	return true;
+}
+
+static void action_free(struct action_t *a)
+{
+	if (a->argv)
+		free(a->argv[0]);
+	free(a->argv);
+	free(a->cmd);
+}
+
+static const struct action_t *config_add_default(struct config_t *c, const char *name, const char *script, const char *args)
+{
+	struct action_t *entry = &c->defaults[c->defaults_count++];
+	config_set_entry(entry, name, "/", script, args);
+	return entry;
+}
+
+static void config_free(struct config_t *c)
+{
+	if (!c)
+		return;
+
+	action_free(&c->down);
+	action_free(&c->up);
+	action_free(&c->click_other);
+	action_free(&c->hold_other);
+
+	unsigned i;
+	for (i=0; i<=ABSOLUTE_MAX_CLICK; ++i)
+		action_free(&c->click[i]);
+	for (i=0; i<=ABSOLUTE_MAX_HOLD; ++i)
+		action_free(&c->hold[i]);
+	for (i=0; i<c->defaults_count; ++i)
+		action_free(&c->defaults[i]);
+
+	free(c);
+}
+
+// Fills in the dispatch tables. Entries not in the config fall back to the defaults, if enabled, and then to the
+// _OTHER entries.
+static void config_resolve(struct config_t *c, bool use_defaults)
+{
+	static const struct action_t NO_ACTION;
+
+	unsigned i;
+	char name[ACTION_NAME_SIZE+1];
+
+	const struct action_t *click_other = c->click_other.name[0] ? &c->click_other : &NO_ACTION;
+	const struct action_t *hold_other = c->hold_other.name[0] ? &c->hold_other : &NO_ACTION;
+
+	c->down_action = &NO_ACTION;
+	if (c->down.name[0])
+		c->down_action = &c->down;
+	else if (use_defaults)
+		c->down_action = config_add_default(c, DOWN_VALUE_NAME, DEFAULT_DOWN, DEFAULT_DOWN_ARGS);
+
+	c->up_action = &NO_ACTION;
+	if (c->up.name[0])
+		c->up_action = &c->up;
+	else if (use_defaults)
+		c->up_action = config_add_default(c, UP_VALUE_NAME, DEFAULT_UP, "");
+
+	for (i=0; i<=ABSOLUTE_MAX_CLICK; ++i)
+	{
+		const struct action_t *a = click_other;
+		if (c->click[i].name[0])
+			a = &c->click[i];
+		else if (use_defaults && i == 1)
+			a = config_add_default(c, "CLICK_1", DEFAULT_CLICK_1, "");
+		else if (use_defaults && i == 2)
+			a = config_add_default(c, "CLICK_2", DEFAULT_CLICK_2, "");
+		else if (use_defaults && i == 3)
+			a = config_add_default(c, "CLICK_3", DEFAULT_CLICK_3, "");
+		c->click_table[i] = a;
+	}
+	c->click_table[ABSOLUTE_MAX_CLICK+1] = click_other;
+
+	for (i=0; i<=ABSOLUTE_MAX_HOLD; ++i)
+	{
+		const struct action_t *a = hold_other;
+		if (c->hold[i].name[0])
+			a = &c->hold[i];
+		else if (use_defaults && i == 3)
+			a = config_add_default(c, "HOLD_3S", DEFAULT_HOLD_3S, "");
+		else if (use_defaults && i == 5)
+			a = config_add_default(c, "HOLD_5S", DEFAULT_HOLD_5S, "");
+		c->hold_table[i] = a;
+	}
+	c->hold_table[ABSOLUTE_MAX_HOLD+1] = hold_other;
+
+	for (i=0; i<=ABSOLUTE_MAX_CLICK; ++i)
+	{
+		snprintf(name, sizeof(name), CLICK_NAME, i);
+		debug(4, "%s resolves to %s '%s'\n", name, c->click_table[i]->name, c->click_table[i]->cmd ? c->click_table[i]->cmd : "");
+	}
+	for (i=0; i<=ABSOLUTE_MAX_HOLD; ++i)
+	{
+		snprintf(name, sizeof(name), HOLD_NAME, i);
+		debug(4, "%s resolves to %s '%s'\n", name, c->hold_table[i]->name, c->hold_table[i]->cmd ? c->hold_table[i]->cmd : "");
+	}
+}
+
+// Parses the whole config in one go into a config for each button. A missing file results in the defaults only,
+// those apply to the first button. The first occurrence of a name wins.
+static bool config_load(const char *conf, struct config_t **configs)
+{
+	const size_t BUFFER_SIZE = 2 * MAX_PATH_LENGTH + 1;
+	char *line = malloc(BUFFER_SIZE);
+	char prefixes[MAX_BUTTONS][ACTION_NAME_SIZE+1];
+
+	unsigned b;
+	bool allocated = line != NULL;
+	for (b=0; b<g_button_count; ++b)
+	{
+		configs[b] = calloc(1, sizeof(struct config_t));
+		allocated = allocated && configs[b];
+		button_prefix(prefixes[b], sizeof(prefixes[b]), b);
+	}
+
+	if (!allocated)
+	{
+		fprintf(stderr, "Failed allocating memory for the config!\n");
+		free(line);
+		for (b=0; b<g_button_count; ++b)
+			free(configs[b]);
+		return false;
+	}
+
+	size_t currentLine = 0;
+
+	FILE *f = fopen(conf, "rt");
+
+	while (f && !feof(f))
+	{
+		if (!read_line(f, line, BUFFER_SIZE))
+			continue;
+
+		++currentLine;
+
+		char *commentMarker = strchr(line, '#');
+		if (commentMarker)
+			*commentMarker = '\0'; // Ignore comments.
+
+		char *endline = strchr(line, '\n');
+		if (endline)
+			*endline = '\0'; // Ignore endline.
+
+		static const char *WHITESPACE_CHARS = " \t";
+
+		// remove leading spaces
+		char *name = line + strspn(line, WHITESPACE_CHARS);
+
+		if (strlen(name) <= 1)
+			continue;
+
+		char *value = "";
+		char *args = "";
+
+		// if there is whitespace after the name there may be a value, followed by arguments.
+		char *t = strpbrk(name, WHITESPACE_CHARS);
+		if (t)
+		{
+			*t = '\0';
+			value = t + 1 + strspn(t + 1, WHITESPACE_CHARS);
+
+			char *a = strpbrk(value, WHITESPACE_CHARS);
+			if (a)
+			{
+				*a = '\0';
+				args = a + 1 + strspn(a + 1, WHITESPACE_CHARS);
+			}
+		}
+
+		if (strlen(value) >= MAX_PATH_LENGTH || strlen(args) >= MAX_PATH_LENGTH)
+		{
+			fprintf(stderr, "Too long value set in %s on line %lu!\n", conf, currentLine);
+			continue;
+		}
+
+		const char *full_name = name;
+		struct config_t *c = configs[0];
+		for (b=1; b<g_button_count; ++b)
+		{
+			size_t n = strlen(prefixes[b]);
+			if (strncmp(name, prefixes[b], n) == 0)
+			{
+				c = configs[b];
+				name += n;
+				break;
+			}
+		}
+
+		if (strcmp(name, CLICK_COUNT_LIMIT_VALUE_NAME) == 0)
+		{
+			if (!c->click_count_limit_specified && parse_uint(&c->click_count_limit, value))
+				c->click_count_limit_specified = true;
+			continue;
+		}
+
+		if (strcmp(name, CLICK_WINDOW_VALUE_NAME) == 0)
+		{
+			if (!c->click_window_specified && parse_uint(&c->click_window, value) && c->click_window > 0 && c->click_window <= MAX_CLICK_WINDOW_MS)
+				c->click_window_specified = true;
+			else if (!c->click_window_specified)
+				fprintf(stderr, "Invalid %s value in %s on line %lu!\n", name, conf, currentLine);
+			continue;
+		}
+
+		struct action_t *entry = config_find_entry(c, name);
+		if (!entry)
+		{
+			debug(2, "Ignoring unknown name %s in %s on line %lu.\n", name, conf, currentLine);
+			continue;
+		}
+
+		if (entry->name[0])
+			continue;
+
+		debug(4, "config_load located name %s\n", full_name);
+		if (!config_set_entry(entry, full_name, conf, value, args))
+			fprintf(stderr, "Failed allocating memory for %s!\n", full_name);
+	}
+
+	if (f)
+		fclose(f);
+	free(line);
+
+	for (b=0; b<g_button_count; ++b)
+		config_resolve(configs[b], g_use_default && b == 0);
+
+	return true;
+}
+
+static bool action_is_nop(const struct action_t *a)
+{
+	return a->verb == V_NOP || (a->verb == V_EXEC && !a->cmd);
+}
+
+// Scripts without arguments of their own get the click count appended.
+static bool action_takes_click_count(const struct action_t *a)
+{
+	return a->verb == V_EXEC && a->cmd && !a->has_args;
+}
+
+// A click count is final if the limit stops the count there or all the higher counts do nothing. None are, if a hold
+// action gets the click count, as a press following the clicks may still become a hold after them.
+static void config_resolve_final(struct config_t *c, unsigned int limit)
+{
+	unsigned i;
+	bool longer_bound = !action_is_nop(c->click_table[ABSOLUTE_MAX_CLICK+1]);
+
+	for (i=0; i<=ABSOLUTE_MAX_HOLD+1; ++i)
+	{
+		if (action_takes_click_count(c->hold_table[i]))
+		{
+			debug(1, "Clicks wait out the click window, as %s gets the click count.\n", c->hold_table[i]->name);
+			memset(c->click_final, 0, sizeof(c->click_final));
+			return;
+		}
+	}
+
+	for (i=ABSOLUTE_MAX_CLICK+1; i>0; --i)
+	{
+		c->click_final[i] = (limit != 0 && i >= limit) || !longer_bound;
+		if (!action_is_nop(c->click_table[i]))
+			longer_bound = true;
+	}
+	c->click_final[0] = false;
+}
+
+static const struct action_t *config_lookup(const struct config_t *c, enum action_e action, unsigned click_count, unsigned hold_time)
+{
+	unsigned timer;
+
+	switch (action)
+	{
+	case A_DOWN:
+		return c->down_action;
+	case A_UP:
+		return c->up_action;
+	case A_CLICK:
+		return c->click_table[click_count <= ABSOLUTE_MAX_CLICK ? click_count : ABSOLUTE_MAX_CLICK+1];
+	case A_HOLD:
+		timer = TICK_2_SECONDS(hold_time);
+		return c->hold_table[timer <= ABSOLUTE_MAX_HOLD ? timer : ABSOLUTE_MAX_HOLD+1];
+	default:
+		return NULL;
+	}
+}
+
+// Walks through the hold times in ms, noting where the resolved hold action changes to one that does something.
+// seconds() rounds on whole or half seconds in all the time modes, so only those and the click window are checked.
+static void config_resolve_hold_thresholds(struct config_t *c)
+{
+	const unsigned int end = (ABSOLUTE_MAX_HOLD + 2) * 1000;
+	const struct action_t *prev = NULL;
+	unsigned int ms;
+
+	c->hold_threshold_count = 0;
+	c->hold_last_final = false;
+
+	for (ms=g_click_window_ms; ms<=end && c->hold_threshold_count<ABSOLUTE_MAX_HOLD+2; ms=(ms/HOLD_ROUNDING_MS+1)*HOLD_ROUNDING_MS)
+	{
+		const struct action_t *a = config_lookup(c, A_HOLD, 0, ms);
+		if (a == prev)
+			continue;
+
+		prev = a;
+
+		// Even changing to no action, like HOLD_OTHER after HOLD_5S, lets holding on cancel the previous one.
+		c->hold_last_final = !action_is_nop(a);
+		if (c->hold_last_final)
+			c->hold_thresholds[c->hold_threshold_count++] = ms;
+	}
+}
+
+static void config_report_latency(const struct config_t *c, unsigned int limit)
+{
+	unsigned i;
+	unsigned n = limit != 0 && limit <= ABSOLUTE_MAX_CLICK ? limit : ABSOLUTE_MAX_CLICK;
+
+	for (i=1; i<=n; ++i)
+	{
+		const struct action_t *a = c->click_table[i];
+		if (action_is_nop(a))
+			continue;
+
+		// Past the explicitly configured counts, only the limit itself is worth a mention.
+		if (a == c->click_table[ABSOLUTE_MAX_CLICK+1] && i != limit)
+			continue;
+
+		debug(1, "%u click(s) run %s %u ms after the last release.\n", i, a->name, c->click_final[i] ? 0 : g_click_window_ms);
+	}
+
+	for (i=0; i<c->hold_threshold_count; ++i)
+	{
+		const struct action_t *a = config_lookup(c, A_HOLD, 0, c->hold_thresholds[i]);
+		if (g_hold_mode == HM_CROSSING && c->hold_last_final && i + 1 == c->hold_threshold_count)
+			debug(1, "Holding for %u ms runs %s right away.\n", c->hold_thresholds[i], a->name);
+		else
+			debug(1, "Holding for %u ms runs %s on release.\n", c->hold_thresholds[i], a->name);
+	}
+}
+
+// Swaps in the freshly parsed config, the old one is kept if parsing failed.
+static void config_reload(void)
+{
+	struct config_t *configs[MAX_BUTTONS];
+	if (!config_load(g_config_path, configs))
+		return;
+
+	unsigned b;
+	for (b=0; b<g_button_count; ++b)
+	{
+		config_free(g_configs[b]);
+		g_configs[b] = configs[b];
+	}
+
+	// The timing options are common to all buttons, so they're taken without a prefix.
+	const struct config_t *c = g_configs[0];
+	if (!g_click_count_limit_specified)
+		g_click_count_limit = c->click_count_limit_specified ? c->click_count_limit : DEFAULT_CLICK_COUNT_LIMIT;
+	if (!g_click_window_specified)
+		g_click_window_ms = c->click_window_specified ? c->click_window : CLICK_TIMEOUT_MS;
+
+	for (b=0; b<g_button_count; ++b)
+	{
+		config_resolve_final(g_configs[b], g_click_count_limit);
+		config_resolve_hold_thresholds(g_configs[b]);
+		config_report_latency(g_configs[b], g_click_count_limit);
+	}
+}
+
+static void config_free_all(void)
+{
+	unsigned b;
+	for (b=0; b<g_button_count; ++b)
+	{
+		config_free(g_configs[b]);
+		g_configs[b] = NULL;
+	}
+}
+
+static char g_config_watch_name[MAX_PATH_LENGTH+1];
+
+// Watches the directory of the config file, so that it gets noticed whether it's written in place or replaced.
+static int config_watch_open(void)
+{
+	char path[PATH_MAX];
+	char dir[PATH_MAX];
+
+	// /etc/pisound.conf is usually a symlink, watch the file it points to.
+	if (!realpath(g_config_path, path))
+	{
+		strncpy(path, g_config_path, sizeof(path)-1);
+		path[sizeof(path)-1] = '\0';
+	}
+
+	const char *name = strrchr(path, '/');
+	strncpy(g_config_watch_name, name ? name + 1 : path, sizeof(g_config_watch_name)-1);
+	g_config_watch_name[sizeof(g_config_watch_name)-1] = '\0';
+
+	strcpy(dir, path);
+	dirname(dir);
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1)
+	{
+		close(fd);
+		return -1;
+	}
 
+	return fd;
+}
 
-// Reads a line, truncates it if needed, seeks to the next line.
-static bool read_line(FILE *f, char *buffer, size_t n)
+// Returns true if any of the pending events concern the config file.
+static bool config_watch_read(int fd)
 {
-	memset(buffer, 0, n);
-
-	if (fgets(buffer, n, f) == NULL)
-		return false;
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t n;
 
-	if (buffer[n-2] != '\0' && buffer[n-2] != '\n')
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0)
 	{
-		// Whole line didn't fit into the buffer, seek until next line.
-		while (!feof(f))
+		const char *p = buffer;
+		while (p < buffer + n)
 		{
-			int c = fgetc(f);
-			if (c == '\n')
-				break;
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			if (ev->len && strcmp(ev->name, g_config_watch_name) == 0)
+				changed = true;
+			p += sizeof(struct inotify_event) + ev->len;
 		}
 	}
 
-	return true;
+	return changed;
 }
 
-static void read_config_value(const char *conf, const char *value_name, char *dst, char *args, size_t n, const char *default_value)
+enum { MAX_CHILDREN = 16 };
+
+// Running actions, for reporting their runtime once reaped.
+struct child_t
 {
-	const size_t BUFFER_SIZE = 2 * MAX_PATH_LENGTH + 1;
-	char line[BUFFER_SIZE];
-	char name[BUFFER_SIZE];
-	char argument[BUFFER_SIZE];
-	char value[BUFFER_SIZE];
+	pid_t pid;
+	char name[ACTION_NAME_SIZE+1];
+	timestamp_ms_t started_at;
+};
 
-	size_t currentLine = 0;
+static struct child_t g_children[MAX_CHILDREN];
 
-	bool found = false;
+enum { DEFAULT_EXECUTORS = 2 };
+enum { MAX_EXECUTORS     = 8 };
+enum { EXECUTOR_MSG_SIZE = MAX_PATH_LENGTH * 2 + 64 };
 
-	FILE *f = fopen(conf, "rt");
+// Pre-forked processes, waiting for a command to exec, so that an action doesn't have to wait for a fork of the
+// daemon. A used up executor becomes the action's process and a new one is forked in its place afterwards.
+struct executor_t
+{
+	pid_t pid;
+	int fd;
+};
 
-	while (f && !feof(f))
+static struct executor_t g_executors[MAX_EXECUTORS];
+static unsigned int g_executor_count = DEFAULT_EXECUTORS;
+
+static int argv_count(char *const argv[])
+{
+	int n = 0;
+	while (argv[n])
+		++n;
+	return n;
+}
+
+// Like execvp does, files without a #! line or a binary format are run as shell scripts,
+// the way system() used to run them. dst must have room for argv_count(argv) + 2 entries.
+static void make_sh_argv(char **dst, char *const argv[])
+{
+	int i;
+	dst[0] = "/bin/sh";
+	for (i=0; argv[i]; ++i)
+		dst[i+1] = argv[i];
+	dst[i+1] = NULL;
+}
+
+// Receives a single command, as NUL separated arguments, and execs it.
+static void executor_main(int fd)
+{
+	// Start the command with the default signal setup rather than the daemon's.
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = SIG_DFL;
+	sigaction(SIGINT, &action, NULL);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	char msg[EXECUTOR_MSG_SIZE + 1];
+	ssize_t n;
+	do
 	{
-		if (read_line(f, line, BUFFER_SIZE))
-		{
-			++currentLine;
+		n = recv(fd, msg, sizeof(msg) - 1, 0);
+	} while (n == -1 && errno == EINTR);
 
-			argument[0] = '\0';
-			value[0] = '\0';
+	// The daemon has gone away.
+	if (n <= 0)
+		_exit(0);
 
-			char *commentMarker = strchr(line, '#');
-			if (commentMarker)
-				*commentMarker = '\0'; // Ignore comments.
+	msg[n] = '\0';
 
-			char *endline = strchr(line, '\n');
-			if (endline)
-				*endline = '\0'; // Ignore endline.
+	int argc = 0;
+	ssize_t i;
+	for (i=0; i<n; ++i)
+		if (msg[i] == '\0')
+			++argc;
 
-			static const char *WHITESPACE_CHARS = " \t";
+	char *argv[argc + 1];
+	char *p = msg;
+	for (i=0; i<argc; ++i)
+	{
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[argc] = NULL;
 
-			// remove leading spaces
-			char *p = line + strspn(line, WHITESPACE_CHARS);
+	// The socket is close-on-exec, as are the daemon's other descriptors.
+	execv(argv[0], argv);
+	if (errno == ENOEXEC)
+	{
+		char *sh_argv[argc + 2];
+		make_sh_argv(sh_argv, argv);
+		execv(sh_argv[0], sh_argv);
+	}
+	fprintf(stderr, "Failed executing %s! Error %d.\n", argv[0], errno);
+	_exit(127);
+}
 
-			if (strlen(p) > 1)
-			{
-				char *t = strpbrk(p, WHITESPACE_CHARS);
+static int executor_start(struct executor_t *e)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+		return -errno;
 
-				// if there is whitespace after the name there may be a value
-				if (t)
-				{
-					strncpy(name, p, t - p);
-					name[t - p] = '\0';
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		int err = errno;
+		close(sv[0]);
+		close(sv[1]);
+		return -err;
+	}
 
+	if (pid == 0)
+	{
+		close(sv[0]);
+		executor_main(sv[1]);
+	}
 
-					t = t + strspn(t, WHITESPACE_CHARS);
+	close(sv[1]);
+	e->pid = pid;
+	e->fd = sv[0];
 
-					if (args)
-					{
-						char *a1 = strpbrk(t, WHITESPACE_CHARS);
-						if (a1)
-						{
-							char *a2 = a1 + strspn(a1, WHITESPACE_CHARS);
-							if (a2)
-							{
-								strcpy(argument, a2);
-							}
-							*a1 = '\0';
-						}
-					}
+	return 0;
+}
 
-					strcpy(value, t);
-				} else {
-					strncpy(name, p, BUFFER_SIZE);
-				}
-				if (strlen(name) != 0)
-				{
-					if (strcmp(name, value_name) == 0)
-					{
-						debug( 4, "read_config_value located name %s\n", name );
-						size_t lenValue = strlen(value);
-						size_t lenArgs = strlen(argument);
-						if (lenValue < n && lenArgs < n)
-						{
-							found = true;
-
-							strncpy(dst, value, lenValue);
-							dst[lenValue] = '\0';
-
-							if (args)
-							{
-								strncpy(args, argument, lenArgs);
-								args[lenArgs] = '\0';
-							}
-							break;
-						}
-						else
-						{
-							fprintf(stderr, "Too long value set in %s on line %lu!\n", conf, currentLine);
-						}
-					}
-				}
-				else
-				{
-					fprintf(stderr, "Unexpected syntax in %s on line %lu!\n", conf, currentLine);
-				}
-			}
+// Forks the missing executors, called outside of the time critical paths.
+static void executors_fill(void)
+{
+	unsigned int i;
+	for (i=0; i<g_executor_count; ++i)
+	{
+		if (g_executors[i].pid != 0)
+			continue;
+
+		int err = executor_start(&g_executors[i]);
+		if (err < 0)
+		{
+			fprintf(stderr, "Failed starting an executor! Error %d.\n", -err);
+			return;
 		}
+		debug(3, "Started executor %d.\n", g_executors[i].pid);
 	}
+}
 
-	if (f)
-		fclose(f);
+static void executors_close(void)
+{
+	unsigned int i;
+	for (i=0; i<MAX_EXECUTORS; ++i)
+	{
+		if (g_executors[i].pid == 0)
+			continue;
+
+		// The executor exits once it sees the socket closed.
+		close(g_executors[i].fd);
+		g_executors[i].pid = 0;
+		g_executors[i].fd = -1;
+	}
+}
+
+// Returns the pid of the executor that took the command, or -1 if none were available.
+static pid_t executor_run(char *const argv[])
+{
+	char msg[EXECUTOR_MSG_SIZE];
+	size_t n = 0;
+	int i;
+	for (i=0; argv[i]; ++i)
+	{
+		size_t len = strlen(argv[i]) + 1;
+		if (n + len > sizeof(msg))
+			return -1;
+		memcpy(msg + n, argv[i], len);
+		n += len;
+	}
 
-	if (!found)
+	unsigned int j;
+	for (j=0; j<g_executor_count; ++j)
 	{
-		debug( 4, "read_config_value did not find name %s\n", value_name );
-		strcpy(dst, default_value);
-		if (args)
-			*args = '\0';
+		struct executor_t *e = &g_executors[j];
+		if (e->pid == 0)
+			continue;
+
+		pid_t pid = e->pid;
+		bool sent = send(e->fd, msg, n, MSG_NOSIGNAL) == (ssize_t)n;
+
+		// Either way the executor is used up, if it has died, it gets reaped as any other child.
+		close(e->fd);
+		e->pid = 0;
+		e->fd = -1;
+
+		if (sent)
+			return pid;
 	}
+
+	return -1;
 }
 
-static int get_action_name(enum action_e action, char * action_name, unsigned click_count, unsigned hold_time)
+// Starts the action without waiting for it, the children get reaped by reap_children.
+static pid_t spawn(const char *name, char *const argv[])
 {
-	memset( action_name, 0, ACTION_NAME_SIZE+1 );
-	switch (action)
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t pid = executor_run(argv);
+
+	if (pid == -1)
 	{
-	case A_DOWN:
-		strcpy( action_name,  DOWN_VALUE_NAME );
-		break;
-	case A_UP:
-		strcpy( action_name,  UP_VALUE_NAME);
-		break;
-	case A_CLICK:
-		strcpy( action_name,  CLICK_NAME);
-		if (click_count <= ABSOLUTE_MAX_CLICK)
+		// SIGCHLD is blocked in the daemon for the signalfd, don't let the children inherit that.
+		sigemptyset(&mask);
+		posix_spawnattr_init(&attr);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+		posix_spawnattr_setsigmask(&attr, &mask);
+
+		int err = posix_spawn(&pid, argv[0], NULL, &attr, argv, environ);
+		if (err == ENOEXEC)
 		{
-			sprintf( action_name, CLICK_NAME, click_count );
-		} else {
-			strcpy( action_name, CLICK_OTHER_VALUE_NAME );
+			char *sh_argv[argv_count(argv) + 2];
+			make_sh_argv(sh_argv, argv);
+			err = posix_spawn(&pid, sh_argv[0], NULL, &attr, sh_argv, environ);
 		}
-		break;
-	case A_HOLD:
-		strcpy( action_name, HOLD_NAME);
-		unsigned timer = TICK_2_SECONDS(hold_time);
-		if (timer <= ABSOLUTE_MAX_HOLD)
+		posix_spawnattr_destroy(&attr);
+
+		if (err != 0)
 		{
-			sprintf( action_name, HOLD_NAME, timer );
-		} else {
-			strcpy( action_name, HOLD_OTHER_VALUE_NAME );
+			fprintf(stderr, "Failed executing %s for %s! Error %d.\n", argv[0], name, err);
+			return -1;
 		}
-		break;
-	default:
-		break;
 	}
-	debug(3, "action %u click count %u hold time %u (%u seconds) yields action name %s\n", action, click_count, hold_time, TICK_2_SECONDS(hold_time), action_name );
-	return 0;
-}
 
-/*
- * buff_length is the buffer length available for input, (actual length -1 )
- */
-static void get_action_script(enum action_e action, char* action_name, char *buffer, char* args, unsigned int buff_length)
-{
-	if (action_name[0] == '\0')
-	{
-		buffer[0] = '\0';
-	}
-	read_config_value(g_config_path, action_name, buffer, args, buff_length, "#");
-	debug( 2, "read_config_value returned %s\n", buffer );
-	// if buffer[0] == '#' then the entry did not exist in the config file.
-	if (buffer[0] == '#')// entry was not specified -- use defaults.
+	int i;
+	for (i=0; i<MAX_CHILDREN; ++i)
 	{
-		buffer[buff_length] = 0;
-		bool found = false;
-		switch (action)
+		if (g_children[i].pid == 0)
 		{
-		case A_UP:
-			if  (g_use_default) 
-			{
-				strcpy( buffer, DEFAULT_UP );
-				if (args)
-					args[0] = '\0';
-			}
-			break;
-		case A_DOWN:
-			if  (g_use_default) 
-			{
-				strcpy( buffer, DEFAULT_DOWN );
-				if (args)
-					args[0] = '\0';
-			}
-			break;
-		case A_CLICK:
-			if (strcmp("CLICK_1", action_name) == 0 && g_use_default) 
-			{
-				strcpy( buffer, DEFAULT_CLICK_1 );
-				if (args)
-					args[0] = '\0';
-			}
-			else if (strcmp("CLICK_2", action_name) == 0 && g_use_default)
-			{
-				strcpy( buffer, DEFAULT_CLICK_2 );
-				if (args)
-					args[0] = '\0';
-			}
-			else if (strcmp("CLICK_3", action_name) == 0 && g_use_default)
-			{
-				strcpy( buffer, DEFAULT_CLICK_3 );
-				if (args)
-					args[0] = '\0';
-			}
-			else
-			{
-				read_config_value(g_config_path, CLICK_OTHER_VALUE_NAME, buffer, args, buff_length, "#");
-			}
-			break;
-		case A_HOLD:
-			if (strcmp("HOLD_3S", action_name) == 0 && g_use_default)
-			{
-				strcpy( buffer, DEFAULT_HOLD_3S );
-				if (args)
-					args[0] = '\0';
-			}
-			else if (strcmp("HOLD_5S", action_name) == 0 && g_use_default)
-			{
-				strcpy( buffer, DEFAULT_HOLD_5S );
-				if (args)
-					args[0] = '\0';
-			} else {
-				read_config_value(g_config_path, HOLD_OTHER_VALUE_NAME, buffer, args, buff_length, "#");
-			}
-			break;
-		default:
+			g_children[i].pid = pid;
+			strcpy(g_children[i].name, name);
+			g_children[i].started_at = get_timestamp_ms();
 			break;
 		}
 	}
-	// if there is a # at this point entry existed in the config file but had no value
-	if (buffer[0] == '#' ) {
-		buffer[0] = '\0';
-	}
+
+	debug(2, "Started %s, pid %d.\n", name, pid);
+	return pid;
 }
 
-// length of command or an error (negative number).
-static int get_action_script_path(enum action_e action, char * action_name, unsigned click_count, unsigned hold_time, char *script, char *args, size_t n)
+static void reap_children(void)
 {
-	if (action < 0 || action >= A_COUNT) {
-		return -EINVAL;
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		int i;
+		for (i=0; i<MAX_CHILDREN; ++i)
+		{
+			if (g_children[i].pid != pid)
+				continue;
+
+			debug(1, "%s (pid %d) exited with status %d after %llu ms.\n", g_children[i].name, pid,
+				WIFEXITED(status) ? WEXITSTATUS(status) : -1, get_timestamp_ms() - g_children[i].started_at);
+			g_children[i].pid = 0;
+			break;
+		}
 	}
+}
 
-	get_action_name(action, action_name, click_count, hold_time);
-	if (action_name[0] == '\0')
+static int g_led_fd = -1;
+static int g_led_timer_fd = -1;
+static unsigned int g_led_blink_duration;
+
+static void led_flash(unsigned int duration)
+{
+	if (g_led_fd == -1)
 	{
-		return -EINVAL;
+		g_led_fd = open(PISOUND_LED_FILE, O_WRONLY | O_CLOEXEC);
+		if (g_led_fd == -1)
+		{
+			fprintf(stderr, "Failed opening %s! Error %d.\n", PISOUND_LED_FILE, errno);
+			return;
+		}
 	}
 
-	char action_script[MAX_PATH_LENGTH + 1];
-	char arguments[MAX_PATH_LENGTH + 1];
+	char value[8];
+	int n = snprintf(value, sizeof(value), "%u\n", duration);
+	if (pwrite(g_led_fd, value, n, 0) != n)
+		fprintf(stderr, "Failed writing to %s! Error %d.\n", PISOUND_LED_FILE, errno);
+}
+
+// The first flash comes after a period, so holding the button down blinks once for every second held.
+static void led_blink(unsigned int duration, unsigned int period_ms)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
 
-	get_action_script(action, action_name, action_script, arguments, MAX_PATH_LENGTH );
+	its.it_value.tv_sec = period_ms / 1000;
+	its.it_value.tv_nsec = (period_ms % 1000) * 1000 * 1000;
+	its.it_interval = its.it_value;
 
-	debug(1, "script = '%s', args = '%s'\n", action_script, arguments);
+	g_led_blink_duration = duration;
+	if (g_led_timer_fd != -1)
+		timerfd_settime(g_led_timer_fd, 0, &its, NULL);
+}
 
-	if (action_script[0] == '\0')
-	{
-		return 0;
-	}
-	// The path is absolute.
-	if (action_script[0] == '/')
+static void led_blink_timeout(void)
+{
+	uint64_t t;
+	if (read(g_led_timer_fd, &t, sizeof(t)) == sizeof(t))
+		led_flash(g_led_blink_duration);
+}
+
+// Like killall, matches the process name, not the full command line.
+static void signal_processes(const char *process, int signum)
+{
+	DIR *dir = opendir("/proc");
+	if (!dir)
 	{
-		strncpy(script, action_script, n-2);
-		script[n-1] = '\0';
+		fprintf(stderr, "Failed opening /proc! Error %d.\n", errno);
+		return;
 	}
-	else // The path is relative to the config file location.
+
+	pid_t self = getpid();
+	unsigned int count = 0;
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
 	{
-		char tmp[MAX_PATH_LENGTH + 1];
+		unsigned int pid;
+		if (!parse_uint(&pid, d->d_name) || (pid_t)pid == self)
+			continue;
+
+		char path[64];
+		char comm[32];
+		snprintf(path, sizeof(path), "/proc/%u/comm", pid);
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			continue;
 
-		size_t pathLength = strlen(g_config_path);
-		strncpy(tmp, g_config_path, sizeof(tmp)-1);
-		dirname(tmp);
-		strncat(tmp, "/", sizeof(tmp)-1 - strlen(tmp));
-		strncat(tmp, action_script, sizeof(tmp)-1 - strlen(tmp));
-		tmp[sizeof(tmp)-1] = '\0';
+		ssize_t n = read(fd, comm, sizeof(comm) - 1);
+		close(fd);
+		if (n <= 0)
+			continue;
+
+		comm[n] = '\0';
+
+		if (comm[n-1] == '\n')
+			comm[n-1] = '\0';
 
-		strncpy(script, tmp, n-1);
-		script[n-1] = '\0';
+		if (strcmp(comm, process) == 0 && kill((pid_t)pid, signum) == 0)
+			++count;
 	}
 
-	strncpy(args, arguments, n-1);
-	args[n-1] = '\0';
+	closedir(dir);
+
+	debug(2, "Sent signal %d to %u %s processes.\n", signum, count, process);
+}
+
+// Returns true if the action was a built-in one and has been carried out.
+static bool execute_verb(const struct action_t *a)
+{
+	switch (a->verb)
+	{
+	case V_EXEC:
+		return false;
+	case V_NOP:
+		break;
+	case V_LED:
+		led_flash(a->led_duration);
+		break;
+	case V_LED_BLINK:
+		led_blink(a->led_duration, a->period_ms);
+		break;
+	case V_LED_STOP:
+		led_blink(0, 0);
+		break;
+	case V_SIGNAL:
+		signal_processes(a->process, a->signum);
+		break;
+	}
 
-	return strlen(script);
+	debug(2, "execute_action: %s done in-process.\n", a->name);
+	return true;
 }
 
-static void execute_action(enum action_e action, unsigned click_count, unsigned hold_time)
+static void execute_action(const struct config_t *c, enum action_e action, unsigned click_count, unsigned hold_time)
 {
-	char cmd[MAX_PATH_LENGTH + 64];
-	char arg[MAX_PATH_LENGTH + 64];
-	char action_name[ ACTION_NAME_SIZE+1 ];
-	int n = get_action_script_path(action, action_name, click_count, hold_time, cmd, arg, sizeof(cmd));
-	if (n < 0)
+	const struct action_t *a = config_lookup(c, action, click_count, hold_time);
+	if (!a)
 	{
-		debug(1, "execute_action: getting script path for action %u click count %u hold time %u (%u seconds) resulted in error %d!\n", action, click_count, hold_time, TICK_2_SECONDS(hold_time), n);
+		debug(1, "execute_action: unknown action %u!\n", action);
 		return;
 	}
 
-	if (n == 0)
+	if (execute_verb(a))
+		return;
+
+	if (!a->cmd)
 	{
-		debug(1, "execute_action: no command for action %s : click count %u hold time %u (%u seconds)\n", action_name, click_count, hold_time, TICK_2_SECONDS(hold_time));
+		debug(1, "execute_action: no command for action %s : click count %u hold time %u (%u seconds)\n", a->name, click_count, hold_time, TICK_2_SECONDS(hold_time));
 		return;
 	}
-	debug(2, "execute_action: action %u click count %u hold time %u (%u seconds)\ncmd %s\nargs %s\n", action, click_count, hold_time, TICK_2_SECONDS(hold_time), cmd, arg);
-	char *p = cmd + n;
-	size_t remainingSpace = sizeof(cmd) - n + 1;
-	int result = 0;
 
-	switch (action)
+	debug(2, "execute_action: action %s click count %u hold time %u (%u seconds)\ncmd %s\n", a->name, click_count, hold_time, TICK_2_SECONDS(hold_time), a->cmd);
+
+	bool append = !a->has_args && (action == A_CLICK || action == A_HOLD);
+	char click_arg[16];
+	char hold_arg[16];
+	snprintf(click_arg, sizeof(click_arg), "%u", click_count);
+	snprintf(hold_arg, sizeof(hold_arg), "%u", hold_time);
+
+	if (a->argv)
 	{
-	case A_CLICK:
-		if (strlen(arg) == 0) result = snprintf(p, remainingSpace, " %u", click_count);
-		else result = snprintf(p, remainingSpace, " %s", arg);
-		break;
-	case A_HOLD:
-		if (strlen(arg) == 0) result = snprintf(p, remainingSpace, " %u %u", click_count, hold_time);
-		else result = snprintf(p, remainingSpace, " %s", arg);
-		break;
-	default:
-		break;
+		char *argv[a->argc + 3];
+		memcpy(argv, a->argv, a->argc * sizeof(char *));
+		int argc = a->argc;
+		if (append)
+		{
+			argv[argc++] = click_arg;
+			if (action == A_HOLD)
+				argv[argc++] = hold_arg;
+		}
+		argv[argc] = NULL;
+		spawn(a->name, argv);
+		return;
 	}
 
-	if (result < 0 || result >= remainingSpace)
+	char cmd[MAX_PATH_LENGTH * 2 + 64];
+	int result = snprintf(cmd, sizeof(cmd), "%s%s%s%s%s", a->cmd,
+		append ? " " : "", append ? click_arg : "",
+		append && action == A_HOLD ? " " : "", append && action == A_HOLD ? hold_arg : "");
+
+	if (result < 0 || result >= sizeof(cmd))
 	{
 		fprintf(stderr, "execute_action: failed setting up arguments for action %u, result: %d!\n", action, result);
 		return;
 	}
-	debug(2, "execute_action: executing %s\n", cmd );
-	system(cmd);
+	debug(2, "execute_action: executing %s\n", cmd);
+
+	char *argv[] = { "/bin/sh", "-c", cmd, NULL };
+	spawn(a->name, argv);
 }
 
 static int gpio_is_pin_valid(int pin)
@@ -548,6 +1466,25 @@ enum pull_e
 	P_DOWN = 2,
 };
 
+// Waits briefly for the value node of a freshly exported pin, sysfs doesn't generate inotify events for it.
+static void gpio_wait_for_node(int pin)
+{
+	char value[64];
+	snprintf(value, sizeof(value), "/sys/class/gpio/gpio%d/value", pin);
+
+	unsigned int waited_us = 0;
+	unsigned int delay_us = 500;
+	while (access(value, R_OK | W_OK) != 0 && waited_us < 100000)
+	{
+		usleep(delay_us);
+		waited_us += delay_us;
+		if (delay_us < 16000)
+			delay_us *= 2;
+	}
+
+	debug(2, "Waited %u us for %s.\n", waited_us, value);
+}
+
 // Returns negative value on error, 0 if the pin is already exported, 1 if pin was just exported successfully.
 static int gpio_export(int pin)
 {
@@ -582,8 +1519,7 @@ static int gpio_export(int pin)
 		{
 			return -1;
 		}
-		// Give some time for the pin to appear.
-		usleep(100000);
+		gpio_wait_for_node(pin);
 		return 1;
 	}
 
@@ -728,7 +1664,7 @@ static int gpio_open(int pin)
 
 	snprintf(gpio, sizeof(gpio), "/sys/class/gpio/gpio%d/value", pin);
 
-	int fd = open(gpio, O_RDONLY);
+	int fd = open(gpio, O_RDONLY | O_CLOEXEC);
 
 	if (fd == -1)
 	{
@@ -749,15 +1685,6 @@ static int gpio_close(int fd)
 	return 0;
 }
 
-typedef unsigned long long timestamp_ms_t;
-
-static timestamp_ms_t get_timestamp_ms(void)
-{
-	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC, &tp);
-	return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
-}
-
 static bool is_update_check_enabled()
 {
 	struct stat s;
@@ -856,24 +1783,24 @@ static bool get_pisound_id(char *dst, size_t length)
 	return read_pisound_system_file(dst, length, PISOUND_ID_FILE);
 }
 
-static void onTimesClicked(unsigned num_presses)
+static void onTimesClicked(const struct config_t *c, unsigned num_presses)
 {
-	execute_action(A_CLICK, num_presses, 0);
+	execute_action(c, A_CLICK, num_presses, 0);
 }
 
-static void onDown()
+static void onDown(const struct config_t *c)
 {
-	execute_action(A_DOWN, 0, 0);
+	execute_action(c, A_DOWN, 0, 0);
 }
 
-static void onUp()
+static void onUp(const struct config_t *c)
 {
-	execute_action(A_UP, 0, 0);
+	execute_action(c, A_UP, 0, 0);
 }
 
-static void onHold(unsigned num_presses, timestamp_ms_t time_held)
+static void onHold(const struct config_t *c, unsigned num_presses, timestamp_ms_t time_held)
 {
-	execute_action(A_HOLD, num_presses, time_held);
+	execute_action(c, A_HOLD, num_presses, time_held);
 }
 
 #ifdef LIBGPIOD2
@@ -897,7 +1824,79 @@ static int gpiochip_filter(const struct dirent *d)
 	if (!gpiod_is_gpiochip_device(path))
 		return 0;
 
-	return 1;
+	return 1;
+}
+#endif
+
+#ifdef LIBGPIOD2
+// The chip found on a previous run is remembered along with its label, so it's opened directly if it's still there.
+static struct gpiod_chip *open_cached_gpiochip(void)
+{
+	char path[256];
+	char label[64];
+
+	FILE *f = fopen(GPIOCHIP_CACHE_FILE, "rt");
+	if (!f)
+		return NULL;
+
+	int n = fscanf(f, "%255s %63s", path, label);
+	fclose(f);
+	if (n != 2)
+		return NULL;
+
+	struct gpiod_chip *chip = gpiod_chip_open(path);
+	if (!chip)
+		return NULL;
+
+	bool matches = false;
+	struct gpiod_chip_info *info = gpiod_chip_get_info(chip);
+	if (info)
+	{
+		const char *l = gpiod_chip_info_get_label(info);
+		matches = l && strcmp(l, label) == 0;
+		gpiod_chip_info_free(info);
+	}
+
+	if (!matches)
+	{
+		debug(1, "Cached gpiochip %s no longer matches, searching again.\n", path);
+		gpiod_chip_close(chip);
+		return NULL;
+	}
+
+	debug(2, "Using cached gpiochip %s (%s).\n", path, label);
+	return chip;
+}
+
+static void save_gpiochip_cache(struct gpiod_chip *chip)
+{
+	struct gpiod_chip_info *info = gpiod_chip_get_info(chip);
+	if (!info)
+		return;
+
+	const char *path = gpiod_chip_get_path(chip);
+	const char *label = gpiod_chip_info_get_label(info);
+
+	char tmp[MAX_PATH_LENGTH+1];
+	snprintf(tmp, sizeof(tmp), "%s.%d", GPIOCHIP_CACHE_FILE, getpid());
+
+	FILE *f = NULL;
+	if (path && label && (mkdir(GPIOCHIP_CACHE_DIR, 0755) == 0 || errno == EEXIST))
+		f = fopen(tmp, "wt");
+
+	if (f)
+	{
+		bool ok = fprintf(f, "%s %s\n", path, label) > 0;
+		ok = fclose(f) == 0 && ok;
+		if (!ok || rename(tmp, GPIOCHIP_CACHE_FILE) != 0)
+			unlink(tmp);
+	}
+	else
+	{
+		debug(2, "Can't cache the gpiochip in %s. Error %d.\n", GPIOCHIP_CACHE_FILE, errno);
+	}
+
+	gpiod_chip_info_free(info);
 }
 #endif
 
@@ -908,6 +1907,10 @@ static struct gpiod_chip *open_rpi_gpiochip()
 	};
 
 #ifdef LIBGPIOD2
+	struct gpiod_chip *cached = open_cached_gpiochip();
+	if (cached)
+		return cached;
+
 	struct dirent **namelist;
 	int num = scandir("/dev", &namelist, gpiochip_filter, versionsort);
 
@@ -976,6 +1979,9 @@ static struct gpiod_chip *open_rpi_gpiochip()
 		free(namelist[i]);
 	free(namelist);
 
+	if (chip)
+		save_gpiochip_cache(chip);
+
 	return chip;
 #else
 	int i;
@@ -1008,6 +2014,9 @@ static void gpio_pin_close(struct gpio_pin_t *pin)
 	{
 #ifndef LIBGPIOD2
 		close(pin->fd);
+#else
+		if (pin->evdev)
+			close(pin->fd);
 #endif
 		pin->fd = -1;
 	}
@@ -1031,7 +2040,8 @@ static void gpio_pin_close(struct gpio_pin_t *pin)
 	pin->offset = -1;
 }
 
-static int gpio_pin_open_input(struct gpio_pin_t *pin, int offset, enum edge_e edge, enum pull_e pull, const bool *active_low)
+// The legacy sysfs gpio class interface, only used if the character device can't be.
+static int gpio_pin_open_sysfs(struct gpio_pin_t *pin, int offset, enum edge_e edge, const bool *active_low)
 {
 	struct gpio_pin_t p;
 	p.line = NULL;
@@ -1039,12 +2049,15 @@ static int gpio_pin_open_input(struct gpio_pin_t *pin, int offset, enum edge_e e
 	p.exported = false;
 	p.events = 0;
 	p.offset = offset;
+	p.hw_debounce = false;
+	p.evdev = false;
 
-	// First attempt access via sysfs gpio class, otherwise, try libgpiod.
 	int err = gpio_export(offset);
 
-	if (err < 0) goto gpiod;
-	else p.exported = (err == 1);
+	if (err < 0)
+		return ENOENT;
+
+	p.exported = (err == 1);
 
 	if (active_low)
 	{
@@ -1067,16 +2080,39 @@ static int gpio_pin_open_input(struct gpio_pin_t *pin, int offset, enum edge_e e
 
 	p.events = POLLPRI;
 
-	goto success;
+	memcpy(pin, &p, sizeof(p));
+	return 0;
+
+cleanup:
+	gpio_pin_close(&p);
+	return err;
+}
+
+// Several lines can only be requested together through libgpiod v2, otherwise each has to be opened on its own.
+static int gpio_pin_open_gpiod(struct gpio_pin_t *pin, const int *offsets, unsigned int count, enum edge_e edge, enum pull_e pull, const bool *active_low, unsigned int debounce_ms)
+{
+	int offset = offsets[0];
+	struct gpio_pin_t p;
+	p.line = NULL;
+	p.fd = -1;
+	p.exported = false;
+	p.events = 0;
+	p.offset = offset;
+	p.hw_debounce = false;
+	p.evdev = false;
 
-gpiod:
 	if (!g_chip || !g_cfg || !g_event_buffer)
 	{
-		fprintf(stderr, "Won't attempt opening with libgpiod as the gpiochip was not found!\n");
+		debug(1, "Won't attempt opening with libgpiod as the gpiochip was not found!\n");
 		return ENOENT;
 	}
 
+	int err;
+
 #ifndef LIBGPIOD2
+	if (count > 1)
+		return EINVAL;
+
 	p.line = gpiod_chip_get_line(g_chip, offset);
 
 	if (!p.line)
@@ -1129,8 +2165,6 @@ gpiod:
 
 	p.fd = gpiod_line_event_get_fd(p.line);
 	p.events = POLLIN | POLLPRI;
-
-	goto success;
 #else
 	struct gpiod_line_config *cfg = gpiod_line_config_new();
 	if (!cfg)
@@ -1199,80 +2233,568 @@ gpiod:
 		goto cleanup;
 	}
 
-	unsigned int offsets = offset;
+	// The kernel filters the bounces, falling back to its own timer if the GPIO controller can't.
+	if (debounce_ms > 0)
+	{
+		gpiod_line_settings_set_debounce_period_us(settings, debounce_ms * 1000ul);
+		p.hw_debounce = true;
+	}
+
+	// Event timestamps are compared against CLOCK_MONOTONIC timers.
+	err = gpiod_line_settings_set_event_clock(settings, GPIOD_LINE_CLOCK_MONOTONIC);
+	if (err != 0)
+	{
+		err = errno;
+		goto cleanup;
+	}
+
+	unsigned int line_offsets[MAX_BUTTONS];
+	unsigned int i;
+	for (i=0; i<count; ++i)
+		line_offsets[i] = offsets[i];
+
+	err = gpiod_line_config_add_line_settings(cfg, line_offsets, count, settings);
+	if (err != 0)
+	{
+		err = errno;
+		goto cleanup;
+	}
+
+	p.line = gpiod_chip_request_lines(g_chip, g_cfg, cfg);
+	if (!p.line)
+	{
+		err = errno;
+		goto cleanup;
+	}
+
+	p.fd = gpiod_line_request_get_fd(p.line);
+	p.events = POLLIN | POLLPRI;
+
+	gpiod_line_settings_free(settings);
+	gpiod_line_config_free(cfg);
+#endif
+
+	memcpy(pin, &p, sizeof(p));
+	return 0;
+
+cleanup:
+#ifdef LIBGPIOD2
+	if (settings)
+		gpiod_line_settings_free(settings);
+	if (cfg)
+		gpiod_line_config_free(cfg);
+#endif
+
+	gpio_pin_close(&p);
+	return err;
+}
+
+static int input_filter(const struct dirent *d)
+{
+	return strncmp(d->d_name, "event", 5) == 0;
+}
+
+// The Pisound driver owns its button line, so neither libgpiod nor sysfs can get edge events for it. The driver
+// passes them on through an input device instead, debounced and with kernel timestamps.
+static int gpio_pin_open_evdev(struct gpio_pin_t *pin, int offset)
+{
+	struct dirent **namelist;
+	int num = scandir("/dev/input", &namelist, input_filter, alphasort);
+	if (num < 0)
+		return errno;
+
+	int fd = -1;
+	int i;
+	for (i=0; i<num; ++i)
+	{
+		char path[PATH_MAX];
+		int err = snprintf(path, sizeof(path), "/dev/input/%s", namelist[i]->d_name);
+		if (fd == -1 && err > 0 && err < (int)sizeof(path))
+		{
+			fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+			char name[64];
+			memset(name, 0, sizeof(name));
+			if (fd != -1 && (ioctl(fd, EVIOCGNAME(sizeof(name)-1), name) < 0 || strcmp(name, PISOUND_INPUT_NAME) != 0))
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	if (fd == -1)
+		return ENOENT;
+
+	// Event timestamps are compared against CLOCK_MONOTONIC timers.
+	int clock = CLOCK_MONOTONIC;
+	if (ioctl(fd, EVIOCSCLOCKID, &clock) == -1)
+	{
+		int err = errno;
+		close(fd);
+		return err;
+	}
+
+	pin->line = NULL;
+	pin->fd = fd;
+	pin->offset = offset;
+	pin->events = POLLIN;
+	pin->exported = false;
+	pin->hw_debounce = true;
+	pin->evdev = true;
+
+	return 0;
+}
+
+// The character device comes first, sysfs gpio class is the fallback for single lines. The Pisound's own line is
+// read through its driver, unless the opposite activation was asked for.
+static int gpio_pin_open_input(struct gpio_pin_t *pin, const int *offsets, unsigned int count, enum edge_e edge, enum pull_e pull, const bool *active_low, unsigned int debounce_ms)
+{
+	int err;
+	if (count == 1 && offsets[0] == PISOUND_BUTTON_LINE && (!active_low || *active_low))
+	{
+		err = gpio_pin_open_evdev(pin, offsets[0]);
+		if (err == 0)
+		{
+			debug(1, "Reading GPIO %d through the '%s' input device.\n", offsets[0], PISOUND_INPUT_NAME);
+			return 0;
+		}
+	}
+
+	err = gpio_pin_open_gpiod(pin, offsets, count, edge, pull, active_low, debounce_ms);
+	if (err == 0 || count > 1)
+		return err;
+
+	debug(1, "Opening GPIO %d through libgpiod failed (%d), trying sysfs.\n", offsets[0], err);
+	return gpio_pin_open_sysfs(pin, offsets[0], edge, active_low);
+}
+
+struct pin_event_t
+{
+	int            offset;
+	bool           pressed;
+	timestamp_ms_t timestamp;
+};
+
+// Drains all pending edges, stamped with the time the kernel saw them. Returns the event count or a negative error.
+static int gpio_pin_read(struct gpio_pin_t *pin, struct pin_event_t *events, int max_events)
+{
+	if (pin->fd == -1)
+		return -EINVAL;
+	if (pin->evdev)
+	{
+		struct input_event ev[EVENT_BUFFER_SIZE];
+		if (max_events > EVENT_BUFFER_SIZE)
+			max_events = EVENT_BUFFER_SIZE;
+
+		ssize_t bytes = read(pin->fd, ev, max_events * sizeof(ev[0]));
+		if (bytes < 0)
+			return errno == EAGAIN ? 0 : -errno;
+
+		int n = 0;
+		size_t i;
+		for (i=0; i<bytes/sizeof(ev[0]); ++i)
+		{
+			// Just the presses and releases, not the autorepeats or the sync events.
+			if (ev[i].type != EV_KEY || ev[i].code != KEY_PROG1 || ev[i].value > 1)
+				continue;
+
+			events[n].offset = pin->offset;
+			events[n].pressed = ev[i].value == 1;
+			events[n].timestamp = (timestamp_ms_t)ev[i].input_event_sec * 1000 + ev[i].input_event_usec / 1000;
+			++n;
+		}
+		return n;
+	}
+	else if (pin->line)
+	{
+#ifdef LIBGPIOD2
+		int n = gpiod_line_request_read_edge_events(pin->line, g_event_buffer, max_events);
+		if (n < 0)
+			return -errno;
+
+		int i;
+		for (i=0; i<n; ++i)
+		{
+			struct gpiod_edge_event *event = gpiod_edge_event_buffer_get_event(g_event_buffer, i);
+			events[i].offset = gpiod_edge_event_get_line_offset(event);
+			events[i].pressed = gpiod_edge_event_get_event_type(event) == GPIOD_EDGE_EVENT_RISING_EDGE;
+			events[i].timestamp = gpiod_edge_event_get_timestamp_ns(event) / 1000000;
+		}
+		return n;
+#else
+		struct gpiod_line_event ev[EVENT_BUFFER_SIZE];
+		if (max_events > EVENT_BUFFER_SIZE)
+			max_events = EVENT_BUFFER_SIZE;
+
+		int n = gpiod_line_event_read_fd_multiple(pin->fd, ev, max_events);
+		if (n < 0)
+			return -errno;
+
+		// Kernels before 5.7 stamp v1 events with CLOCK_REALTIME, those are no use against our timers.
+		timestamp_ms_t now = get_timestamp_ms();
+
+		int i;
+		for (i=0; i<n; ++i)
+		{
+			events[i].offset = pin->offset;
+			events[i].pressed = ev[i].event_type == GPIOD_LINE_EVENT_RISING_EDGE;
+			events[i].timestamp = timespec_to_ms(&ev[i].ts);
+			if (events[i].timestamp > now)
+				events[i].timestamp = now;
+		}
+		return n;
+#endif
+	}
+	else
+	{
+		if (max_events < 1)
+			return 0;
+
+		char buff[16];
+		memset(buff, 0, sizeof(buff));
+		int n = read(pin->fd, buff, sizeof(buff));
+		if (n == 0)
+		{
+			fprintf(stderr, "Reading pin value returned 0.\n");
+			return -EINVAL;
+		}
+
+		if (lseek(pin->fd, SEEK_SET, 0) == -1)
+		{
+			fprintf(stderr, "Rewinding pin failed. Error %d.\n", errno);
+			return -EINVAL;
+		}
+
+		// sysfs only gives the current value, so the best we can do is the wakeup time.
+		events[0].offset = pin->offset;
+		events[0].pressed = strtoul(buff, NULL, 10) > 0;
+		events[0].timestamp = get_timestamp_ms();
+		return 1;
+	}
+}
+
+// Reads the current level of a line, for checking where it settled after the bounces. Returns 1 if it's active,
+// 0 if not, or a negative error.
+static int gpio_pin_get_value(const struct gpio_pin_t *pin, int offset)
+{
+	if (pin->fd == -1 || pin->evdev)
+		return -EINVAL;
+	if (pin->line)
+	{
+#ifdef LIBGPIOD2
+		int value = gpiod_line_request_get_value(pin->line, offset);
+		return value < 0 ? -errno : value == GPIOD_LINE_VALUE_ACTIVE;
+#else
+		int value = gpiod_line_get_value(pin->line);
+		return value < 0 ? -errno : value > 0;
+#endif
+	}
+
+	char buff[16];
+	memset(buff, 0, sizeof(buff));
+	if (pread(pin->fd, buff, sizeof(buff)-1, 0) <= 0)
+		return -EINVAL;
+
+	return strtoul(buff, NULL, 10) > 0;
+}
+
+// The click and hold recognition state of a button.
+struct gesture_t
+{
+	unsigned       button;     // Index into g_button_pins and g_configs.
+	const struct gpio_pin_t *pin;
+	int            click_timer;
+	int            hold_timer;
+	timestamp_ms_t pressed_at;
+	timestamp_ms_t click_deadline;
+	bool           timer_running;
+	bool           button_down;
+	unsigned       num_pressed;
+	unsigned       hold_next;  // Index of the next hold threshold to cross.
+	bool           hold_fired; // The hold action already ran while the button was down.
+
+	// Software debouncing, when the kernel couldn't be asked to do it. The line is read again once the debounce
+	// period after an accepted edge is over, in case the edges reporting where it settled were suppressed.
+	int            debounce_timer;
+	timestamp_ms_t last_edge;
+	bool           level;      // The last level passed on to the state machine.
+	unsigned long  suppressed;
+};
+
+static struct gesture_t g_gestures[MAX_BUTTONS];
+
+// Arms the timer to fire at the given CLOCK_MONOTONIC time, in the past means right away.
+static void timer_set_at(int timerfd, timestamp_ms_t at)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+
+	its.it_value.tv_sec = at / 1000;
+	its.it_value.tv_nsec = (at % 1000) * 1000 * 1000;
+
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, 0);
+}
+
+static void gesture_on_timeout(struct gesture_t *g)
+{
+	if (!g->timer_running)
+		return;
+
+	if (!g->button_down)
+		onTimesClicked(g_configs[g->button], g->num_pressed);
+	g->timer_running = false;
+}
+
+static void gesture_arm_hold(struct gesture_t *g)
+{
+	const struct config_t *c = g_configs[g->button];
+
+	if (g_hold_mode != HM_CROSSING || g->hold_timer == -1 || g->hold_next >= c->hold_threshold_count)
+		return;
+
+	timer_set_at(g->hold_timer, g->pressed_at + c->hold_thresholds[g->hold_next]);
+}
+
+// A hold threshold was crossed while the button is still down.
+static void gesture_on_hold_timeout(struct gesture_t *g)
+{
+	const struct config_t *c = g_configs[g->button];
+
+	uint64_t t;
+	if (read(g->hold_timer, &t, sizeof(t)) != sizeof(t))
+		return;
+
+	// The config may have been reloaded in the meantime.
+	if (!g->button_down || g->hold_fired || g->hold_next >= c->hold_threshold_count)
+		return;
+
+	unsigned int held = c->hold_thresholds[g->hold_next++];
+
+	if (g->hold_next == c->hold_threshold_count && c->hold_last_final)
+	{
+		g->hold_fired = true;
+		onHold(c, g->num_pressed, held);
+		return;
+	}
+
+	led_flash(HOLD_FEEDBACK_FLASH);
+	gesture_arm_hold(g);
+}
+
+static bool gesture_soft_debounce(const struct gesture_t *g)
+{
+	return g_debounce_ms != 0 && g->debounce_timer != -1 && !(g->pin && g->pin->hw_debounce);
+}
+
+// Returns false for edges following the last accepted one closer than the debounce period, and ones not changing
+// the level, which sysfs reports when the value was read mid bounce.
+static bool gesture_debounce(struct gesture_t *g, const struct pin_event_t *ev)
+{
+	if (!gesture_soft_debounce(g))
+		return true;
+
+	if (ev->pressed == g->level)
+		return false;
+
+	if (g->last_edge != 0 && ev->timestamp - g->last_edge < g_debounce_ms)
+	{
+		++g->suppressed;
+		debug(2, "Suppressed a bouncing edge on GPIO line %d.\n", ev->offset);
+		return false;
+	}
+
+	g->last_edge = ev->timestamp;
+	g->level = ev->pressed;
+
+	// A past time, as v1 and sysfs timestamps may be, fires right away.
+	timer_set_at(g->debounce_timer, ev->timestamp + g_debounce_ms);
+	return true;
+}
+
+static void gesture_on_edge(struct gesture_t *g, const struct pin_event_t *ev)
+{
+	const struct config_t *c = g_configs[g->button];
+
+	if (!gesture_debounce(g, ev))
+		return;
+
+	// A batch of edges may span the click window, close it where the kernel timestamps say it ended.
+	if (g->timer_running && ev->timestamp >= g->click_deadline)
+		gesture_on_timeout(g);
+
+	if (ev->pressed)
+	{
+		g->button_down = true;
+		onDown(c);
+
+		if (!g->timer_running)
+		{
+			g->num_pressed = 1;
+			g->timer_running = true;
+		}
+		else
+		{
+			if (g_click_count_limit == 0 || g->num_pressed < g_click_count_limit)
+				++g->num_pressed;
+		}
+
+		g->pressed_at = ev->timestamp;
+
+		// The click window is measured from the edge, not from when we got to handle it.
+		g->click_deadline = ev->timestamp + g_click_window_ms;
+		timer_set_at(g->click_timer, g->click_deadline);
+
+		g->hold_next = 0;
+		g->hold_fired = false;
+		gesture_arm_hold(g);
+	}
+	else if (g->button_down)
+	{
+		g->button_down = false;
+		onUp(c);
+
+		if (g->hold_timer != -1)
+			timer_set_at(g->hold_timer, 0); // Disarm.
+
+		if (g->pressed_at != 0 && !g->hold_fired)
+		{
+			if (ev->timestamp - g->pressed_at >= g_click_window_ms)
+			{
+				onHold(c, g->num_pressed, ev->timestamp - g->pressed_at);
+			}
+		}
+
+		// Nothing could come of waiting for more presses.
+		if (g->timer_running && g->num_pressed <= ABSOLUTE_MAX_CLICK + 1 && c->click_final[g->num_pressed])
+		{
+			timer_set_at(g->click_timer, 0); // Disarm.
+			gesture_on_timeout(g);
+		}
+	}
+}
+
+// The debounce period after an accepted edge is over, pass on the level if it settled different from that edge.
+static void gesture_on_debounce_timeout(struct gesture_t *g)
+{
+	uint64_t t;
+	if (read(g->debounce_timer, &t, sizeof(t)) != sizeof(t) || !g->pin)
+		return;
 
-	err = gpiod_line_config_add_line_settings(cfg, &offsets, 1, settings);
-	if (err != 0)
-	{
-		err = errno;
-		goto cleanup;
-	}
+	struct pin_event_t ev;
+	ev.offset = g_button_pins[g->button];
 
-	p.line = gpiod_chip_request_lines(g_chip, g_cfg, cfg);
-	if (!p.line)
-	{
-		err = errno;
-		goto cleanup;
-	}
+	int value = gpio_pin_get_value(g->pin, ev.offset);
+	if (value < 0 || (value > 0) == g->level)
+		return;
 
-	p.fd = gpiod_line_request_get_fd(p.line);
-	p.events = POLLIN | POLLPRI;
+	debug(2, "GPIO line %d settled %s after the bounces.\n", ev.offset, value ? "pressed" : "released");
 
-	gpiod_line_settings_free(settings);
-	gpiod_line_config_free(cfg);
-#endif
+	ev.pressed = value > 0;
+	ev.timestamp = get_timestamp_ms();
+	gesture_on_edge(g, &ev);
+}
 
-success:
-	memcpy(pin, &p, sizeof(p));
-	return 0;
+static struct gesture_t *gesture_for_line(int offset)
+{
+	unsigned b;
+	for (b=0; b<g_button_count; ++b)
+		if (g_button_pins[b] == offset)
+			return &g_gestures[b];
 
-cleanup:
-#ifdef LIBGPIOD2
-	if (settings)
-		gpiod_line_settings_free(settings);
-	if (cfg)
-		gpiod_line_config_free(cfg);
-#endif
+	return NULL;
+}
 
-	gpio_pin_close(&p);
-	return err;
+static void print_stats(void)
+{
+	unsigned b;
+	for (b=0; b<g_button_count; ++b)
+	{
+		const struct gesture_t *g = &g_gestures[b];
+		if (g->pin && g->pin->evdev)
+			printf("GPIO line %d: read through the '%s' input device, debounced by the Pisound driver.\n", g_button_pins[b], PISOUND_INPUT_NAME);
+		else if (g_debounce_ms == 0)
+			printf("GPIO line %d: debouncing is disabled.\n", g_button_pins[b]);
+		else if (g->pin && g->pin->hw_debounce)
+			printf("GPIO line %d: debouncing %u ms in the kernel, bounces are not seen by pisound-btn.\n", g_button_pins[b], g_debounce_ms);
+		else
+			printf("GPIO line %d: debouncing %u ms in pisound-btn, suppressed %lu edges.\n", g_button_pins[b], g_debounce_ms, g->suppressed);
+	}
+	fflush(stdout);
 }
 
-static int gpio_pin_read(struct gpio_pin_t *pin)
+static void gpio_pins_close(void)
 {
-	if (pin->fd == -1)
-		return -EINVAL;
-	if (pin->line)
+	unsigned i;
+	for (i=0; i<g_pin_count; ++i)
+		gpio_pin_close(&g_pins[i]);
+	g_pin_count = 0;
+}
+
+// Requests all the lines together if possible, otherwise one by one.
+static int gpio_pins_open(void)
+{
+	bool active_low = g_pin_activation == PA_ACTIVE_LOW;
+	const bool *active = g_pin_activation != PA_UNSPECIFIED ? &active_low : NULL;
+
+	int err = gpio_pin_open_input(&g_pins[0], g_button_pins, g_button_count, E_BOTH, P_UP, active, g_debounce_ms);
+	unsigned b;
+
+	if (err == 0)
 	{
-#ifdef LIBGPIOD2
-		gpiod_line_request_read_edge_events(pin->line, g_event_buffer, 1);
-		struct gpiod_edge_event *event = gpiod_edge_event_buffer_get_event(g_event_buffer, 0);
-		return gpiod_edge_event_get_event_type(event) == GPIOD_EDGE_EVENT_RISING_EDGE;
-#else
-		struct gpiod_line_event ev;
-		gpiod_line_event_read_fd(pin->fd, &ev);
-		return ev.event_type == GPIOD_LINE_EVENT_RISING_EDGE;
-#endif
+		g_pin_count = 1;
+		for (b=0; b<g_button_count; ++b)
+			g_gestures[b].pin = &g_pins[0];
+		return 0;
 	}
-	else
+
+	if (g_button_count == 1)
+		return err;
+
+	for (b=0; b<g_button_count; ++b)
 	{
-		char buff[16];
-		memset(buff, 0, sizeof(buff));
-		int n = read(pin->fd, buff, sizeof(buff));
-		if (n == 0)
+		err = gpio_pin_open_input(&g_pins[b], &g_button_pins[b], 1, E_BOTH, P_UP, active, g_debounce_ms);
+		if (err != 0)
 		{
-			fprintf(stderr, "Reading pin value returned 0.\n");
-			return -EINVAL;
+			fprintf(stderr, "Failed opening GPIO line %d!\n", g_button_pins[b]);
+			gpio_pins_close();
+			return err;
 		}
+		g_pin_count = b + 1;
+		g_gestures[b].pin = &g_pins[b];
+	}
 
-		if (lseek(pin->fd, SEEK_SET, 0) == -1)
-		{
-			fprintf(stderr, "Rewinding pin failed. Error %d.\n", errno);
-			return -EINVAL;
-		}
+	return 0;
+}
 
-		return strtoul(buff, NULL, 10);
-	}
+// Identifies the source of epoll events: the kind of fd in the upper bits, the button or pin index in the lower.
+enum fd_e
+{
+	FD_BUTTON = 0,
+	FD_CLICK  = 1,
+	FD_HOLD   = 2,
+	FD_CONFIG = 3,
+	FD_CHILD  = 4,
+	FD_LED    = 5,
+	FD_DEBOUNCE = 6,
+};
+
+#define FD_TAG(kind, index) (((uint32_t)(kind) << 16) | (index))
+#define FD_TAG_KIND(tag) ((tag) >> 16)
+#define FD_TAG_INDEX(tag) ((tag) & 0xffff)
+
+static int epoll_add(int epfd, int fd, uint32_t events, uint32_t tag)
+{
+	if (fd == -1)
+		return 0;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = tag;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
 static int run(void)
@@ -1307,8 +2829,7 @@ static int run(void)
 		return EINVAL;
 	}
 
-	bool active_low = g_pin_activation == PA_ACTIVE_LOW;
-	int err = gpio_pin_open_input(&g_pin, g_button_pin, E_BOTH, P_UP, g_pin_activation != PA_UNSPECIFIED ? &active_low : NULL);
+	int err = gpio_pins_open();
 
 	if (err != 0)
 	{
@@ -1316,111 +2837,187 @@ static int run(void)
 		return err;
 	}
 
-	enum
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
 	{
-		FD_BUTTON = 0,
-		FD_TIMER  = 1,
-		FD_COUNT
-	};
+		fprintf(stderr, "Creating epoll failed. Error %d.\n", errno);
+		gpio_pins_close();
+		return errno;
+	}
 
-	int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-	if (timerfd == -1)
+	int config_fd = -1;
+	int signal_fd = -1;
+
+	unsigned i;
+	for (i=0; i<g_pin_count; ++i)
+		epoll_add(epfd, g_pins[i].fd, g_pins[i].events, FD_TAG(FD_BUTTON, i));
+
+	for (i=0; i<g_button_count; ++i)
 	{
-		fprintf(stderr, "Creating timer failed. Error %d.\n", errno);
-		gpio_pin_close(&g_pin);
-		return errno;
+		g_gestures[i].button = i;
+		g_gestures[i].click_timer = -1;
+		g_gestures[i].hold_timer = -1;
+		g_gestures[i].debounce_timer = -1;
+	}
+
+	// Every button has its own click timer, and a hold timer, without which hold actions just run on release.
+	for (i=0; i<g_button_count; ++i)
+	{
+		struct gesture_t *g = &g_gestures[i];
+		g->click_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		g->hold_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (g->click_timer == -1)
+		{
+			fprintf(stderr, "Creating timer failed. Error %d.\n", errno);
+			err = errno;
+			goto cleanup;
+		}
+		if (g->hold_timer == -1)
+			fprintf(stderr, "Creating hold timer failed. Error %d.\n", errno);
+
+		epoll_add(epfd, g->click_timer, EPOLLIN, FD_TAG(FD_CLICK, i));
+		epoll_add(epfd, g->hold_timer, EPOLLIN, FD_TAG(FD_HOLD, i));
+
+		// Without the timer, the edges are passed on as they come.
+		if (g_debounce_ms != 0 && g->pin && !g->pin->hw_debounce)
+		{
+			g->debounce_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (g->debounce_timer == -1)
+				fprintf(stderr, "Creating debounce timer failed. Error %d.\n", errno);
+			epoll_add(epfd, g->debounce_timer, EPOLLIN, FD_TAG(FD_DEBOUNCE, i));
+		}
+
+		printf("Listening to events on GPIO line %u.\n", g_button_pins[i]);
 	}
 
-	printf("Listening to events on GPIO line %u.\n", g_button_pin);
+	// Without the watch, the config is just not reloaded.
+	config_fd = config_watch_open();
+	if (config_fd == -1)
+		fprintf(stderr, "Watching %s for changes failed. Error %d.\n", g_config_path, errno);
+	epoll_add(epfd, config_fd, EPOLLIN, FD_TAG(FD_CONFIG, 0));
 
-	struct pollfd pfd[FD_COUNT];
+	// Actions run asynchronously, their exits are collected through the signalfd. SIGUSR1 prints the stats.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
 
-	pfd[FD_BUTTON].fd = g_pin.fd;
-	pfd[FD_BUTTON].events = g_pin.events;
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd == -1)
+	{
+		fprintf(stderr, "Creating signalfd failed. Error %d.\n", errno);
+		err = errno;
+		goto cleanup;
+	}
+	epoll_add(epfd, signal_fd, EPOLLIN, FD_TAG(FD_CHILD, 0));
 
-	pfd[FD_TIMER].fd = timerfd;
-	pfd[FD_TIMER].events = POLLIN;
+	// Drives @led-blink, without it blinking is just skipped.
+	g_led_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (g_led_timer_fd == -1)
+		fprintf(stderr, "Creating LED timer failed. Error %d.\n", errno);
+	epoll_add(epfd, g_led_timer_fd, EPOLLIN, FD_TAG(FD_LED, 0));
 
-	timestamp_ms_t pressed_at = 0;
+	executors_fill();
 
-	bool timer_running = false;
-	bool button_down = false;
-	unsigned num_pressed = 0;
+	struct pin_event_t events[EVENT_BUFFER_SIZE];
+	struct epoll_event ready[MAX_BUTTONS * 4 + 3];
 
 	for (;;)
 	{
-		int result = poll(pfd, FD_COUNT, -1);
+		int result = epoll_wait(epfd, ready, sizeof(ready)/sizeof(ready[0]), -1);
 
 		if (result == -1)
+		{
+			if (errno == EINTR)
+				continue;
 			break;
+		}
 
-		if (result == 0)
-			continue;
-
-		if (pfd[FD_BUTTON].revents) // Button state changed.
+		int r;
+		for (r=0; r<result; ++r)
 		{
-			timestamp_ms_t timestamp = get_timestamp_ms();
-
-			unsigned long pressed = gpio_pin_read(&g_pin) > 0;
+			uint32_t index = FD_TAG_INDEX(ready[r].data.u32);
+			struct gesture_t *g = index < MAX_BUTTONS ? &g_gestures[index] : NULL;
+			uint64_t t;
 
-			if (pressed)
+			switch (FD_TAG_KIND(ready[r].data.u32))
 			{
-				button_down = true;
-				onDown();
-
-				if (!timer_running)
-				{
-					num_pressed = 1;
-					timer_running = true;
-				}
-				else
+			case FD_BUTTON: // Button state changed.
 				{
-					if (g_click_count_limit == 0 || num_pressed < g_click_count_limit)
-						++num_pressed;
-				}
-
-				pressed_at = timestamp;
-
-				struct itimerspec its;
-				memset(&its, 0, sizeof(its));
+					int n = gpio_pin_read(&g_pins[index], events, EVENT_BUFFER_SIZE);
 
-				its.it_value.tv_sec = 0;
-				its.it_value.tv_nsec = CLICK_TIMEOUT_MS * 1000 * 1000;
-				timerfd_settime(timerfd, 0, &its, 0); // Start the timer.
-			}
-			else if (button_down)
-			{
-				button_down = false;
-				onUp();
-
-				if (pressed_at != 0)
+					int j;
+					for (j=0; j<n; ++j)
+					{
+						g = gesture_for_line(events[j].offset);
+						if (g)
+							gesture_on_edge(g, &events[j]);
+					}
+				}
+				break;
+			case FD_CLICK: // Click timer timed out.
+				if (read(g->click_timer, &t, sizeof(t)) == sizeof(t))
+					gesture_on_timeout(g);
+				break;
+			case FD_HOLD: // Hold threshold reached.
+				gesture_on_hold_timeout(g);
+				break;
+			case FD_DEBOUNCE: // Bounces settled.
+				gesture_on_debounce_timeout(g);
+				break;
+			case FD_CHILD: // Actions exited or stats requested.
 				{
-					if (timestamp - pressed_at >= HOLD_PRESS_TIMEOUT_MS)
+					struct signalfd_siginfo si;
+					while (read(signal_fd, &si, sizeof(si)) == sizeof(si))
 					{
-						onHold(num_pressed, timestamp - pressed_at);
+						if (si.ssi_signo == SIGUSR1)
+							print_stats();
 					}
+					reap_children();
 				}
+				break;
+			case FD_LED: // Time for the next blink.
+				led_blink_timeout();
+				break;
+			case FD_CONFIG: // Config file changed.
+				if (config_watch_read(config_fd))
+				{
+					debug(1, "Reloading %s.\n", g_config_path);
+					config_reload();
+				}
+				break;
 			}
-
-		}
-		if (pfd[FD_TIMER].revents & POLLIN) // Timer timed out.
-		{
-			uint64_t t;
-			int n = read(timerfd, &t, sizeof(t));
-			if (n != sizeof(t))
-			{
-				fprintf(stderr, "Error %d reading the timer!\n", errno);
-				return errno;
-			}
-			if (!button_down)
-				onTimesClicked(num_pressed);
-			timer_running = false;
 		}
+
+		// Only once all the ready events are handled, so the forks don't delay the actions of a batch.
+		executors_fill();
 	}
 
-	close(timerfd);
-	gpio_pin_close(&g_pin);
-	return 0;
+	err = 0;
+
+cleanup:
+	executors_close();
+	if (g_led_timer_fd != -1)
+		close(g_led_timer_fd);
+	if (g_led_fd != -1)
+		close(g_led_fd);
+	if (signal_fd != -1)
+		close(signal_fd);
+	if (config_fd != -1)
+		close(config_fd);
+	for (i=0; i<g_button_count; ++i)
+	{
+		if (g_gestures[i].click_timer != -1)
+			close(g_gestures[i].click_timer);
+		if (g_gestures[i].hold_timer != -1)
+			close(g_gestures[i].hold_timer);
+		if (g_gestures[i].debounce_timer != -1)
+			close(g_gestures[i].debounce_timer);
+	}
+	close(epfd);
+	gpio_pins_close();
+	return err;
 }
 
 static void print_version(void)
@@ -1435,12 +3032,28 @@ static void print_usage(void)
 		"\t--help                   Display the usage information.\n"
 		"\t--version                Show the version information.\n"
 		"\t--gpio <line_id>         The GPIO line id of RPi GPIO header to use for the button. Default is 17 (PIN11). Use `gpioinfo` to list available pins.\n"
+		"\t                         Repeat for more buttons, up to 8. The actions of the extra ones are configured with a GPIO<line_id>_ prefix,\n"
+		"\t                         like GPIO27_CLICK_1.\n"
+		"\t                         The Pisound driver owns line 17, so it's read through the driver's 'pisound button' input device,\n"
+		"\t                         with kernel timestamps and debouncing. Drivers lacking it leave line 17 to sysfs, timed\n"
+		"\t                         by when pisound-btn wakes up.\n"
 		"\t--active-high            Configure the pin for active high triggering.\n"
 		"\t--active-low             Reverse the sense of the active state.\n"
 		"\t                         If none of --active-high or --active-low is specified, this GPIO setting is left as is.\n"
 		"\t--conf <path>            Specify the path to configuration file to use. Default is /etc/pisound.conf.\n"
 		"\t--click-count-limit <n>  Set the click count limit to n. Use 0 for no limit. Default is 8.\n"
+		"\t--click-window <ms>      Presses closer than ms continue the click sequence, also the shortest hold. Default is 400.\n"
+		"\t                         Clicks that no longer sequence could change run right on release. Not if a hold action\n"
+		"\t                         gets the click count, as a hold following the clicks is passed their count.\n"
+		"\t--hold-mode <mode>       'crossing' flashes the LEDs as each hold action is reached, and runs the last one right away\n"
+		"\t                         if every longer hold resolves to it too, otherwise on release. 'release' runs hold actions\n"
+		"\t                         only on release, as older versions did. Default is crossing.\n"
 		"\t--no-defaults            Do not use the default values for click and hold. Only configuration options will be used.\n"
+		"\t--debounce <ms>          Ignore edges closer than ms to the previous one, 0 to disable. Default is 10, at most 1000.\n"
+		"\t                         The line is read again ms after each accepted edge, so the level it settles at isn't lost.\n"
+		"\t                         Done by the kernel when using libgpiod v2. The Pisound driver's input device uses its own\n"
+		"\t                         button_debounce_ms module parameter instead. Send SIGUSR1 to print the suppressed edge count.\n"
+		"\t--executors <n>          Number of pre-forked processes ready to run actions, 0 to fork on demand. Default is 2, at most 8.\n"
 		"\t--debug <n>              Enable debugging at level n (higher value = more logging)\n"
 		"\t-n <n>                   Short for --click-count-limit.\n"
 		"\t-q                       Short for --debug 0 (turns off all but errors)\n"
@@ -1503,43 +3116,9 @@ static void print_time_help(void)
 		"\n"
 		);
 }
-static bool parse_uint(unsigned int *dst, const char *src)
-{
-	char * endPtr;
-	uint32_t x = strtoul(src, &endPtr, 10);
-	if (endPtr == src || *endPtr != '\0')
-	{
-		*dst = 0;
-		return false;
-	}
-	*dst = x;
-	return true;
-}
-
-static bool read_config_uint(const char *conf, const char *value_name, unsigned int *dst, unsigned int default_value)
-{
-	char buffer[12];
-	read_config_value(conf, value_name, buffer, NULL, sizeof(buffer), "#");
-	if (buffer[0] == '#') // No value was specified.
-	{
-		*dst = default_value;
-		return false;
-	}
-
-	if (parse_uint(dst, buffer))
-	{
-		return true;
-	}
-	else
-	{
-		*dst = default_value;
-		return false;
-	}
-}
-
 static void cleanup(void)
 {
-	gpio_pin_close(&g_pin);
+	gpio_pins_close();
 }
 
 static void sigint_handler(int signum)
@@ -1557,7 +3136,6 @@ int main(int argc, char **argv, char **envp)
 
 	int i;
 	bool conf_path_specified = false;
-	bool click_count_limit_specified = false;
 	for (i=1; i<argc; ++i)
 	{
 		if (strcmp(argv[i], "--help") == 0)
@@ -1629,7 +3207,7 @@ int main(int argc, char **argv, char **envp)
 				if (parse_uint(&x, argv[i+1]))
 				{
 					g_click_count_limit = x;
-					click_count_limit_specified = true;
+					g_click_count_limit_specified = true;
 					++i;
 				}
 				else
@@ -1651,9 +3229,15 @@ int main(int argc, char **argv, char **envp)
 			if (i + 1 < argc)
 			{
 				unsigned int x;
-				if (parse_uint(&x, argv[i+1]))
+				if (!g_button_pins_specified)
+				{
+					g_button_count = 0;
+					g_button_pins_specified = true;
+				}
+
+				if (parse_uint(&x, argv[i+1]) && g_button_count < MAX_BUTTONS && !gesture_for_line((int)x))
 				{
-					g_button_pin = (int)x;
+					g_button_pins[g_button_count++] = (int)x;
 					++i;
 				}
 				else
@@ -1670,6 +3254,107 @@ int main(int argc, char **argv, char **envp)
 				return 1;
 			}
 		}
+		else if (strcmp(argv[i], "--click-window") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				unsigned int x;
+				if (parse_uint(&x, argv[i+1]) && x > 0 && x <= MAX_CLICK_WINDOW_MS)
+				{
+					g_click_window_ms = x;
+					g_click_window_specified = true;
+					++i;
+				}
+				else
+				{
+					printf("Failed parsing period argument for '%s'!\n", argv[i]);
+					print_usage();
+					return 1;
+				}
+			}
+			else
+			{
+				printf("Missing period argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--hold-mode") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				if (strcmp(argv[i+1], "crossing") == 0)
+				{
+					g_hold_mode = HM_CROSSING;
+					++i;
+				}
+				else if (strcmp(argv[i+1], "release") == 0)
+				{
+					g_hold_mode = HM_RELEASE;
+					++i;
+				}
+				else
+				{
+					printf("Unknown mode '%s' for '%s'!\n", argv[i+1], argv[i]);
+					print_usage();
+					return 1;
+				}
+			}
+			else
+			{
+				printf("Missing mode argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--debounce") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				unsigned int x;
+				if (parse_uint(&x, argv[i+1]) && x <= MAX_DEBOUNCE_MS)
+				{
+					g_debounce_ms = x;
+					++i;
+				}
+				else
+				{
+					printf("Failed parsing period argument for '%s'!\n", argv[i]);
+					print_usage();
+					return 1;
+				}
+			}
+			else
+			{
+				printf("Missing period argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--executors") == 0)
+		{
+			if (i + 1 < argc)
+			{
+				unsigned int x;
+				if (parse_uint(&x, argv[i+1]) && x <= MAX_EXECUTORS)
+				{
+					g_executor_count = x;
+					++i;
+				}
+				else
+				{
+					printf("Failed parsing count argument for '%s'!\n", argv[i]);
+					print_usage();
+					return 1;
+				}
+			}
+			else
+			{
+				printf("Missing count argument for '%s'!\n", argv[i]);
+				print_usage();
+				return 1;
+			}
+		}
 		else if (strcmp(argv[i], "--active-low") == 0)
 		{
 			g_pin_activation = PA_ACTIVE_LOW;
@@ -1703,10 +3388,9 @@ int main(int argc, char **argv, char **envp)
 		}
 	}
 
-	if (!click_count_limit_specified)
-	{
-		read_config_uint(g_config_path, CLICK_COUNT_LIMIT_VALUE_NAME, &g_click_count_limit, g_click_count_limit);
-	}
+	config_reload();
+	if (!g_configs[0])
+		return ENOMEM;
 
 	g_chip = open_rpi_gpiochip();
 #ifdef LIBGPIOD2
@@ -1722,7 +3406,7 @@ int main(int argc, char **argv, char **envp)
 		else
 		{
 			gpiod_request_config_set_consumer(g_cfg, "pisound-btn");
-			g_event_buffer = gpiod_edge_event_buffer_new(1);
+			g_event_buffer = gpiod_edge_event_buffer_new(EVENT_BUFFER_SIZE);
 			if (!g_event_buffer)
 			{
 				fprintf(stderr, "Failed creating gpiod event buffer!\n");
@@ -1748,5 +3432,7 @@ int main(int argc, char **argv, char **envp)
 	if (g_chip)
 		gpiod_chip_close(g_chip);
 
+	config_free_all();
+
 	return ret;
 }
@@ -0,0 +1,104 @@
+/*
+ * test-hold.c
+ *
+ * program to test which hold actions run as soon as their threshold is crossed.
+ *
+ * Loads configs into pisound-btn's dispatch tables and checks the hold thresholds found in them, and whether
+ * the last one is final, so it may run before release in --hold-mode crossing.
+ *
+ * Usage: test-hold [path to the stock pisound.conf]
+ */
+
+#define main pisound_btn_main
+#include "pisound-btn.c"
+#undef main
+
+struct hold_test_t
+{
+	const char   *name;
+	const char   *conf;         // Contents of the config, NULL for the stock one.
+	bool         use_defaults;
+	unsigned int thresholds[8]; // Expected, zero terminated.
+	bool         last_final;
+};
+
+static const char *g_stock_conf = "pisound.conf";
+
+static int run_test(const struct hold_test_t *t)
+{
+	char path[] = "/tmp/test-hold-XXXXXX";
+
+	if (t->conf)
+	{
+		int fd = mkstemp(path);
+		if (fd == -1 || write(fd, t->conf, strlen(t->conf)) != (ssize_t)strlen(t->conf))
+		{
+			printf("%s: failed writing the config!\n", t->name);
+			return 1;
+		}
+		close(fd);
+	}
+
+	strncpy(g_config_path, t->conf ? path : g_stock_conf, sizeof(g_config_path)-1);
+	g_use_default = t->use_defaults;
+	config_reload();
+
+	if (t->conf)
+		unlink(path);
+
+	const struct config_t *c = g_configs[0];
+	if (!c)
+	{
+		printf("%s: failed loading the config!\n", t->name);
+		return 1;
+	}
+
+	int err = 0;
+	unsigned i;
+	for (i=0; t->thresholds[i] || i < c->hold_threshold_count; ++i)
+	{
+		unsigned int found = i < c->hold_threshold_count ? c->hold_thresholds[i] : 0;
+		if (found != t->thresholds[i])
+		{
+			printf("%s: threshold %u is %u not %u\n", t->name, i, found, t->thresholds[i]);
+			err = 1;
+		}
+	}
+
+	if (c->hold_last_final != t->last_final)
+	{
+		printf("%s: last threshold is %sfinal\n", t->name, c->hold_last_final ? "" : "not ");
+		err = 1;
+	}
+
+	printf("%-40s %s\n", t->name, err ? "FAIL" : "ok");
+
+	config_free_all();
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct hold_test_t tests[] =
+	{
+		// Holding past 7 s resolves to HOLD_OTHER, which cancels the shutdown at 5 s.
+		{ "stock pisound.conf",                   NULL, true, { 400, 3000, 5000 }, false },
+		{ "stock defaults, no config",            "", true, { 3000, 5000 }, false },
+		{ "HOLD_5S then nothing",                 "HOLD_5S @nop\nHOLD_3S @led 10\n", false, { 3000 }, false },
+		{ "HOLD_OTHER only",                      "HOLD_OTHER @led 10\n", false, { 400 }, true },
+		{ "HOLD_3S, HOLD_OTHER past it",          "HOLD_3S @led 10\nHOLD_OTHER @led 20\n", false, { 400, 3000, 5000 }, true },
+		{ "HOLD_3S, HOLD_5S, nothing past it",    "HOLD_3S @led 10\nHOLD_5S @led 20\n", false, { 3000, 5000 }, false },
+	};
+
+	if (argc > 1)
+		g_stock_conf = argv[1];
+
+	g_debug = 0;
+
+	int err = 0;
+	unsigned i;
+	for (i=0; i<sizeof(tests)/sizeof(tests[0]); ++i)
+		err |= run_test(&tests[i]);
+
+	return err;
+}
@@ -26,9 +26,20 @@
 #include <linux/sysfs.h>
 #include <linux/delay.h>
 #include <linux/spi/spi.h>
+#include <linux/component.h>
+#include <linux/of.h>
 #include <linux/interrupt.h>
 #include <linux/kfifo.h>
 #include <linux/jiffies.h>
+#include <linux/idr.h>
+#include <linux/slab.h>
+#include <linux/input.h>
+#include <linux/hrtimer.h>
+#include <linux/leds.h>
+#include <linux/cpumask.h>
+#include <linux/irq.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <sound/core.h>
 #include <sound/pcm.h>
@@ -39,29 +50,252 @@
 #include <sound/asequencer.h>
 #include <sound/control.h>
 
-static int pisnd_spi_init(struct device *dev);
-static void pisnd_spi_uninit(void);
+static unsigned int fifo_in_size = 4096;
+module_param(fifo_in_size, uint, 0444);
+MODULE_PARM_DESC(fifo_in_size,
+	"Size of the MIDI input FIFO in bytes, rounded up to a power of 2");
+
+static unsigned int fifo_out_size = 4096;
+module_param(fifo_out_size, uint, 0444);
+MODULE_PARM_DESC(fifo_out_size,
+	"Size of the MIDI output FIFO in bytes, rounded up to a power of 2");
+
+static unsigned int fifo_in_high_watermark = 75;
+module_param(fifo_in_high_watermark, uint, 0444);
+MODULE_PARM_DESC(fifo_in_high_watermark,
+	"Input FIFO fill level in percent at which reading from the firmware is paused");
+
+static unsigned int fifo_in_low_watermark = 25;
+module_param(fifo_in_low_watermark, uint, 0444);
+MODULE_PARM_DESC(fifo_in_low_watermark,
+	"Input FIFO fill level in percent at which reading from the firmware is resumed");
+
+enum { MIN_FIFO_SIZE = 128 };
+
+static bool low_latency;
+module_param(low_latency, bool, 0644);
+MODULE_PARM_DESC(low_latency,
+	"Constrain PCM periods to sizes known to run reliably at low latency");
+
+static char *cpus = "";
+module_param(cpus, charp, 0444);
+MODULE_PARM_DESC(cpus,
+	"CPU list to run the SPI interrupt and MIDI worker on, empty for any");
+
+static unsigned int capture_frames;
+module_param(capture_frames, uint, 0444);
+MODULE_PARM_DESC(capture_frames,
+	"Size of the SPI frame capture ring in frames, 0 to disable");
+
+static bool credit_flow = true;
+module_param(credit_flow, bool, 0444);
+MODULE_PARM_DESC(credit_flow,
+	"Pace MIDI output by the free space reported by the firmware, if supported");
+
+struct pisnd_capture_frame {
+	u64                           ns;
+	u32                           transfer;
+	uint8_t                       tx[2];
+	uint8_t                       rx[2];
+};
+
+/* Progress of the SysEx message going through in one direction. */
+struct pisnd_sysex_stats {
+	bool                          active;
+	u64                           bytes;
+	ktime_t                       started_at;
+	ktime_t                       ended_at;
+	ktime_t                       last_byte_at;
+	u64                           total_bytes;
+	unsigned int                  messages;
+};
+
+static unsigned int button_debounce_ms = 10;
+module_param(button_debounce_ms, uint, 0444);
+MODULE_PARM_DESC(button_debounce_ms,
+	"Button debounce time in milliseconds, 0 to disable");
+
+static bool button_gestures;
+module_param(button_gestures, bool, 0444);
+MODULE_PARM_DESC(button_gestures,
+	"Decode button clicks and holds in the driver and send them as uevents");
+
+struct pisnd_led_step {
+	uint8_t                       flash;
+	unsigned int                  period_ms;
+};
+
+enum { LED_PATTERN_MAX_STEPS = 16 };
+enum { LED_PATTERN_MIN_PERIOD_MS = 10 };
 
-static void pisnd_spi_flush(void);
-static void pisnd_spi_start(void);
-static uint8_t pisnd_spi_recv(uint8_t *buffer, uint8_t length);
+/* Flash duration for turning the LED on from a trigger. */
+enum { LED_DEFAULT_FLASH = 1 };
+
+enum pisnd_gesture_e {
+	GESTURE_CLICK = 0,
+	GESTURE_HOLD,
+};
+
+struct pisnd_gesture {
+	enum pisnd_gesture_e          type;
+	unsigned int                  clicks;
+	unsigned int                  hold_ms;
+};
+
+enum { MAX_VERSION_STR_LEN = 6 };
 
 typedef void (*pisnd_spi_recv_cb)(void *data);
-static void pisnd_spi_set_callback(pisnd_spi_recv_cb cb, void *data);
 
-static const char *pisnd_spi_get_serial(void);
-static const char *pisnd_spi_get_id(void);
-static const char *pisnd_spi_get_fw_version(void);
-static const char *pisnd_spi_get_hw_version(void);
+/* All the state of a single Pisound instance. The fields used on every SPI
+ * transfer and MIDI interrupt are kept together at the start of the
+ * structure, ahead of the FIFO storage, the rest is only touched during
+ * setup or via sysfs.
+ */
+struct pisnd {
+	struct spi_device             *spi;
+	struct gpio_desc              *data_available;
+	struct workqueue_struct       *workqueue;
+	struct snd_rawmidi_substream  *midi_output_substream;
+	pisnd_spi_recv_cb             recv_callback;
+	void                          *recv_data;
+	uint8_t                       led_flash_duration;
+	bool                          led_flash_duration_changed;
+	struct work_struct            work_process;
+	int                           work_cpu;
+	int                           last_irq_cpu;
+	int                           last_work_cpu;
+
+	DECLARE_KFIFO_PTR(spi_fifo_in,  uint8_t);
+	DECLARE_KFIFO_PTR(spi_fifo_out, uint8_t);
+
+	/* Transfer buffers of the worker, and spi_transfer16 before it's
+	 * started, heap allocated, as SPI buffers must be DMA safe.
+	 */
+	uint8_t                       *txbuf;
+	uint8_t                       *rxbuf;
+	uint8_t                       *midibuf;
+
+	/* Input backpressure, in bytes of spi_fifo_in, only touched by the
+	 * worker, except for the counters read via sysfs.
+	 */
+	unsigned int                  in_high_watermark;
+	unsigned int                  in_low_watermark;
+	bool                          in_throttled;
+	unsigned long                 in_throttle_count;
+	unsigned long                 in_dropped;
+
+	/* MIDI output flow control, see pisnd_enable_credits. */
+	bool                          credits_enabled;
+	bool                          credits_confirmed;
+	int                           out_credits;
+	unsigned long                 credit_frames;
+	unsigned int                  credit_wait_transfers;
+	ktime_t                       credit_wait_since;
+
+	/* SysEx seen on the SPI link, switches the worker to bulk mode. */
+	struct pisnd_sysex_stats      sysex_out;
+	struct pisnd_sysex_stats      sysex_in;
+
+	struct kobject                kobj;
+	int                           index;
+
+	/* Where the SPI interrupt and worker are kept, empty for anywhere. */
+	struct cpumask                cpus;
+
+	/* SPI frame capture ring, see capture_frames. */
+	spinlock_t                    capture_lock;
+	struct pisnd_capture_frame    *capture;
+	unsigned int                  capture_size;
+	unsigned int                  capture_head;
+	unsigned int                  capture_count;
+	u32                           capture_transfer;
+	struct dentry                 *debugfs;
+
+	struct gpio_desc              *spi_reset;
+	struct gpio_descs             *osr;
+	struct gpio_desc              *reset;
+	struct gpio_desc              *button;
+
+	struct input_dev              *button_input;
+	int                           button_irq;
+	struct hrtimer                button_timer;
+	u64                           button_debounce_ns;
+	ktime_t                       button_edge_at;
+	bool                          button_pressed;
+
+	/* Gesture decoding, mirroring the state machine in pisound-btn.
+	 * The state is updated from the button interrupt and timers, the
+	 * uevents are sent from gesture_work.
+	 */
+	spinlock_t                    gesture_lock;
+	struct hrtimer                gesture_timer;
+	struct work_struct            gesture_work;
+	bool                          gesture_timer_running;
+	bool                          gesture_down;
+	unsigned int                  gesture_clicks;
+	ktime_t                       gesture_pressed_at;
+	unsigned int                  click_window_ms;
+	unsigned int                  click_count_limit;
+	DECLARE_KFIFO(gesture_fifo, struct pisnd_gesture, 16);
+
+	/* LED pattern engine, led_steps[led_step] is the one playing. */
+	struct led_classdev           led;
+	char                          led_name[32];
+	bool                          led_registered;
+	spinlock_t                    led_lock;
+	struct hrtimer                led_timer;
+	struct pisnd_led_step         led_steps[LED_PATTERN_MAX_STEPS];
+	unsigned int                  led_step_count;
+	unsigned int                  led_step;
+	int                           led_repeat;
+
+	/* The rate the ADC is currently clocked for, 0 if unknown. */
+	unsigned int                  rate;
+	unsigned long                 adc_resets;
+	unsigned long                 adc_reset_skips;
+
+	/* Time to the first capture data, see pisnd_first_capture_timer. */
+	ktime_t                       adc_ready_at;
+	struct hrtimer                first_capture_timer;
+	struct snd_pcm_substream      *first_capture_substream;
+	snd_pcm_uframes_t             first_capture_hw_ptr;
+	s64                           first_capture_us;
+
+	struct snd_rawmidi            *rmidi;
+
+	struct snd_soc_card           card;
+	struct snd_soc_dai_link       dai;
+
+	char serial_num[11];
+	char id[25];
+	char fw_version[MAX_VERSION_STR_LEN];
+	char hw_version[MAX_VERSION_STR_LEN];
+	u16 fw_version_code;
+};
+
+static int pisnd_spi_init(struct pisnd *pisnd, struct device *dev);
+static void pisnd_spi_uninit(struct pisnd *pisnd);
+
+static void pisnd_spi_flush(struct pisnd *pisnd);
+static void pisnd_spi_start(struct pisnd *pisnd);
+static unsigned int pisnd_spi_peek(struct pisnd *pisnd, uint8_t *buffer, unsigned int length);
+static void pisnd_spi_consume(struct pisnd *pisnd, unsigned int length);
+
+static void pisnd_spi_set_callback(struct pisnd *pisnd, pisnd_spi_recv_cb cb, void *data);
+
+static const char *pisnd_spi_get_serial(struct pisnd *pisnd);
+static const char *pisnd_spi_get_id(struct pisnd *pisnd);
+static const char *pisnd_spi_get_fw_version(struct pisnd *pisnd);
+static const char *pisnd_spi_get_hw_version(struct pisnd *pisnd);
 
-static int pisnd_midi_init(struct snd_card *card);
-static void pisnd_midi_uninit(void);
+static int pisnd_midi_init(struct pisnd *pisnd, struct snd_card *card);
+static void pisnd_midi_uninit(struct pisnd *pisnd);
 
 enum task_e {
 	TASK_PROCESS = 0,
 };
 
-static void pisnd_schedule_process(enum task_e task);
+static void pisnd_schedule_process(struct pisnd *pisnd, enum task_e task);
 
 #define PISOUND_LOG_PREFIX "pisound: "
 
@@ -74,18 +308,24 @@ static void pisnd_schedule_process(enum task_e task);
 #define printe(...) pr_err(PISOUND_LOG_PREFIX __VA_ARGS__)
 #define printi(...) pr_info(PISOUND_LOG_PREFIX __VA_ARGS__)
 
-static struct snd_rawmidi *g_rmidi;
-static struct snd_rawmidi_substream *g_midi_output_substream;
+static DEFINE_IDA(pisnd_ida);
+
+static inline struct pisnd *pisnd_from_substream(
+	struct snd_rawmidi_substream *substream
+	)
+{
+	return substream->rmidi->private_data;
+}
 
 static int pisnd_output_open(struct snd_rawmidi_substream *substream)
 {
-	g_midi_output_substream = substream;
+	pisnd_from_substream(substream)->midi_output_substream = substream;
 	return 0;
 }
 
 static int pisnd_output_close(struct snd_rawmidi_substream *substream)
 {
-	g_midi_output_substream = NULL;
+	pisnd_from_substream(substream)->midi_output_substream = NULL;
 	return 0;
 }
 
@@ -94,7 +334,9 @@ static void pisnd_output_trigger(
 	int up
 	)
 {
-	if (substream != g_midi_output_substream) {
+	struct pisnd *pisnd = pisnd_from_substream(substream);
+
+	if (substream != pisnd->midi_output_substream) {
 		printe("MIDI output trigger called for an unexpected stream!");
 		return;
 	}
@@ -102,12 +344,12 @@ static void pisnd_output_trigger(
 	if (!up)
 		return;
 
-	pisnd_spi_start();
+	pisnd_spi_start(pisnd);
 }
 
 static void pisnd_output_drain(struct snd_rawmidi_substream *substream)
 {
-	pisnd_spi_flush();
+	pisnd_spi_flush(pisnd_from_substream(substream));
 }
 
 static int pisnd_input_open(struct snd_rawmidi_substream *substream)
@@ -120,25 +362,57 @@ static int pisnd_input_close(struct snd_rawmidi_substream *substream)
 	return 0;
 }
 
-static void pisnd_midi_recv_callback(void *substream)
+/* Free space in the rawmidi input buffer. We're the only producer, so it
+ * may only grow behind our back, as the application reads.
+ */
+static unsigned int pisnd_midi_input_space(
+	struct snd_rawmidi_substream *substream
+	)
+{
+	struct snd_rawmidi_runtime *runtime = substream->runtime;
+
+	return runtime->buffer_size - READ_ONCE(runtime->avail);
+}
+
+static void pisnd_midi_recv_callback(void *data)
 {
-	uint8_t data[128];
-	uint8_t n = 0;
+	struct snd_rawmidi_substream *substream = data;
+	struct pisnd *pisnd = pisnd_from_substream(substream);
+	uint8_t buffer[128];
+	unsigned int n, space;
+	int res;
+
+	/* Only hand over what the rawmidi buffer can take, the rest stays
+	 * in spi_fifo_in until the application reads, which triggers the
+	 * input again.
+	 */
+	while ((space = pisnd_midi_input_space(substream)) > 0) {
+		n = pisnd_spi_peek(pisnd, buffer, min_t(unsigned int,
+			space, sizeof(buffer)));
+		if (n == 0)
+			break;
 
-	while ((n = pisnd_spi_recv(data, sizeof(data)))) {
-		int res = snd_rawmidi_receive(substream, data, n);
-		(void)res;
+		res = snd_rawmidi_receive(substream, buffer, n);
 		printd("midi recv %u bytes, res = %d\n", n, res);
+		if (res <= 0)
+			break;
+
+		pisnd_spi_consume(pisnd, res);
 	}
 }
 
 static void pisnd_input_trigger(struct snd_rawmidi_substream *substream, int up)
 {
+	struct pisnd *pisnd = pisnd_from_substream(substream);
+
 	if (up) {
-		pisnd_spi_set_callback(pisnd_midi_recv_callback, substream);
-		pisnd_schedule_process(TASK_PROCESS);
+		pisnd_spi_set_callback(pisnd, pisnd_midi_recv_callback, substream);
+		pisnd_schedule_process(pisnd, TASK_PROCESS);
 	} else {
-		pisnd_spi_set_callback(NULL, NULL);
+		pisnd_spi_set_callback(pisnd, NULL, NULL);
+		/* Let go of any input held back for the reader. */
+		if (pisnd->in_throttled)
+			pisnd_schedule_process(pisnd, TASK_PROCESS);
 	}
 }
 
@@ -172,39 +446,39 @@ static struct snd_rawmidi_global_ops pisnd_global_ops = {
 	.get_port_info = pisnd_get_port_info,
 };
 
-static int pisnd_midi_init(struct snd_card *card)
+static int pisnd_midi_init(struct pisnd *pisnd, struct snd_card *card)
 {
 	int err;
 
-	g_midi_output_substream = NULL;
+	pisnd->midi_output_substream = NULL;
 
-	err = snd_rawmidi_new(card, "pisound MIDI", 0, 1, 1, &g_rmidi);
+	err = snd_rawmidi_new(card, "pisound MIDI", 0, 1, 1, &pisnd->rmidi);
 
 	if (err < 0) {
 		printe("snd_rawmidi_new failed: %d\n", err);
 		return err;
 	}
 
-	strcpy(g_rmidi->name, "pisound MIDI ");
-	strcat(g_rmidi->name, pisnd_spi_get_serial());
+	strcpy(pisnd->rmidi->name, "pisound MIDI ");
+	strcat(pisnd->rmidi->name, pisnd_spi_get_serial(pisnd));
 
-	g_rmidi->info_flags =
+	pisnd->rmidi->info_flags =
 		SNDRV_RAWMIDI_INFO_OUTPUT |
 		SNDRV_RAWMIDI_INFO_INPUT |
 		SNDRV_RAWMIDI_INFO_DUPLEX;
 
-	g_rmidi->ops = &pisnd_global_ops;
+	pisnd->rmidi->ops = &pisnd_global_ops;
 
-	g_rmidi->private_data = (void *)0;
+	pisnd->rmidi->private_data = pisnd;
 
 	snd_rawmidi_set_ops(
-		g_rmidi,
+		pisnd->rmidi,
 		SNDRV_RAWMIDI_STREAM_OUTPUT,
 		&pisnd_output_ops
 		);
 
 	snd_rawmidi_set_ops(
-		g_rmidi,
+		pisnd->rmidi,
 		SNDRV_RAWMIDI_STREAM_INPUT,
 		&pisnd_input_ops
 		);
@@ -212,104 +486,162 @@ static int pisnd_midi_init(struct snd_card *card)
 	return 0;
 }
 
-static void pisnd_midi_uninit(void)
+static void pisnd_midi_uninit(struct pisnd *pisnd)
 {
 }
 
-static void *g_recvData;
-static pisnd_spi_recv_cb g_recvCallback;
-
-#define FIFO_SIZE 4096
-
-static char g_serial_num[11];
-static char g_id[25];
-enum { MAX_VERSION_STR_LEN = 6 };
-static char g_fw_version[MAX_VERSION_STR_LEN];
-static char g_hw_version[MAX_VERSION_STR_LEN];
-
-static uint8_t g_ledFlashDuration;
-static bool    g_ledFlashDurationChanged;
-
-DEFINE_KFIFO(spi_fifo_in,  uint8_t, FIFO_SIZE);
-DEFINE_KFIFO(spi_fifo_out, uint8_t, FIFO_SIZE);
-
-static struct gpio_desc *data_available;
-static struct gpio_desc *spi_reset;
-
-static struct spi_device *pisnd_spi_device;
-
-static struct workqueue_struct *pisnd_workqueue;
-static struct work_struct pisnd_work_process;
-
 static void pisnd_work_handler(struct work_struct *work);
 
-static void spi_transfer(const uint8_t *txbuf, uint8_t *rxbuf, int len);
-static uint16_t spi_transfer16(uint16_t val);
+static void spi_transfer(struct pisnd *pisnd, const uint8_t *txbuf, uint8_t *rxbuf, int len);
+static uint16_t spi_transfer16(struct pisnd *pisnd, uint16_t val);
 
-static int pisnd_init_workqueues(void)
+static int pisnd_init_workqueues(struct pisnd *pisnd)
 {
-	pisnd_workqueue = create_singlethread_workqueue("pisnd_workqueue");
-	INIT_WORK(&pisnd_work_process, pisnd_work_handler);
+	/* A per-CPU workqueue, so the worker can be kept on a chosen CPU.
+	 * There's only work_process on it, and a work item never runs
+	 * concurrently with itself, so it doesn't need to be ordered.
+	 */
+	pisnd->workqueue = alloc_workqueue(
+		"pisnd_workqueue%d",
+		WQ_MEM_RECLAIM,
+		1,
+		pisnd->index
+		);
+	if (!pisnd->workqueue)
+		return -ENOMEM;
+
+	INIT_WORK(&pisnd->work_process, pisnd_work_handler);
 
 	return 0;
 }
 
-static void pisnd_uninit_workqueues(void)
+static void pisnd_uninit_workqueues(struct pisnd *pisnd)
 {
-	flush_workqueue(pisnd_workqueue);
-	destroy_workqueue(pisnd_workqueue);
+	if (!pisnd->workqueue)
+		return;
 
-	pisnd_workqueue = NULL;
+	flush_workqueue(pisnd->workqueue);
+	destroy_workqueue(pisnd->workqueue);
+
+	pisnd->workqueue = NULL;
 }
 
-static bool pisnd_spi_has_more(void)
+static bool pisnd_spi_has_more(struct pisnd *pisnd)
 {
-	return gpiod_get_value(data_available);
+	return gpiod_get_value(pisnd->data_available);
 }
 
-static void pisnd_schedule_process(enum task_e task)
+/* If the worker's CPU went offline, the work is queued on the local one,
+ * which is usually the one handling the interrupt, still one of the
+ * chosen CPUs, if any of them are online.
+ */
+static void pisnd_schedule_process(struct pisnd *pisnd, enum task_e task)
 {
-	if (pisnd_spi_device != NULL &&
-		pisnd_workqueue != NULL &&
-		!work_pending(&pisnd_work_process)
+	int cpu;
+
+	if (pisnd->spi != NULL &&
+		pisnd->workqueue != NULL &&
+		!work_pending(&pisnd->work_process)
 		) {
-		printd("schedule: has more = %d\n", pisnd_spi_has_more());
-		if (task == TASK_PROCESS)
-			queue_work(pisnd_workqueue, &pisnd_work_process);
+		printd("schedule: has more = %d\n", pisnd_spi_has_more(pisnd));
+		if (task != TASK_PROCESS)
+			return;
+
+		cpu = READ_ONCE(pisnd->work_cpu);
+		if (cpu != WORK_CPU_UNBOUND && cpu_online(cpu))
+			queue_work_on(
+				cpu,
+				pisnd->workqueue,
+				&pisnd->work_process
+				);
+		else
+			queue_work(pisnd->workqueue, &pisnd->work_process);
 	}
 }
 
 static irqreturn_t data_available_interrupt_handler(int irq, void *dev_id)
 {
-	if (irq == gpiod_to_irq(data_available) && pisnd_spi_has_more()) {
+	struct pisnd *pisnd = dev_id;
+
+	WRITE_ONCE(pisnd->last_irq_cpu, raw_smp_processor_id());
+
+	if (irq == gpiod_to_irq(pisnd->data_available) &&
+		pisnd_spi_has_more(pisnd)) {
 		printd("schedule from irq\n");
-		pisnd_schedule_process(TASK_PROCESS);
+		pisnd_schedule_process(pisnd, TASK_PROCESS);
 	}
 
 	return IRQ_HANDLED;
 }
 
-static uint16_t spi_transfer16(uint16_t val)
+static uint16_t spi_transfer16(struct pisnd *pisnd, uint16_t val)
 {
-	uint8_t txbuf[2];
-	uint8_t rxbuf[2];
+	uint8_t *txbuf = pisnd->txbuf;
+	uint8_t *rxbuf = pisnd->rxbuf;
 
-	if (!pisnd_spi_device) {
-		printe("pisnd_spi_device null, returning\n");
+	if (!pisnd->spi) {
+		printe("pisnd->spi null, returning\n");
 		return 0;
 	}
 
 	txbuf[0] = val >> 8;
 	txbuf[1] = val & 0xff;
 
-	spi_transfer(txbuf, rxbuf, sizeof(txbuf));
+	spi_transfer(pisnd, txbuf, rxbuf, 2);
 
 	printd("received: %02x%02x\n", rxbuf[0], rxbuf[1]);
 
 	return (rxbuf[0] << 8) | rxbuf[1];
 }
 
-static void spi_transfer(const uint8_t *txbuf, uint8_t *rxbuf, int len)
+/* Records the frames of a completed transfer, overwriting the oldest
+ * ones once the ring is full. All frames of a transfer share its
+ * completion timestamp and sequence number.
+ */
+static void pisnd_capture_frames(
+	struct pisnd *pisnd,
+	const uint8_t *txbuf,
+	const uint8_t *rxbuf,
+	int len
+	)
+{
+	struct pisnd_capture_frame *frame;
+	unsigned long flags;
+	u64 now = ktime_get_ns();
+	int i;
+
+	spin_lock_irqsave(&pisnd->capture_lock, flags);
+
+	if (++pisnd->capture_transfer == 0)
+		pisnd->capture_transfer = 1;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		frame = &pisnd->capture[(pisnd->capture_head +
+			pisnd->capture_count) % pisnd->capture_size];
+
+		frame->ns = now;
+		frame->transfer = pisnd->capture_transfer;
+		frame->tx[0] = txbuf[i];
+		frame->tx[1] = txbuf[i+1];
+		frame->rx[0] = rxbuf[i];
+		frame->rx[1] = rxbuf[i+1];
+
+		if (pisnd->capture_count < pisnd->capture_size)
+			++pisnd->capture_count;
+		else
+			pisnd->capture_head =
+				(pisnd->capture_head + 1) % pisnd->capture_size;
+	}
+
+	spin_unlock_irqrestore(&pisnd->capture_lock, flags);
+}
+
+static void spi_transfer(
+	struct pisnd *pisnd,
+	const uint8_t *txbuf,
+	uint8_t *rxbuf,
+	int len
+	)
 {
 	int err;
 	struct spi_transfer transfer;
@@ -317,8 +649,8 @@ static void spi_transfer(const uint8_t *txbuf, uint8_t *rxbuf, int len)
 
 	memset(rxbuf, 0, len);
 
-	if (!pisnd_spi_device) {
-		printe("pisnd_spi_device null, returning\n");
+	if (!pisnd->spi) {
+		printe("pisnd->spi null, returning\n");
 		return;
 	}
 
@@ -335,446 +667,905 @@ static void spi_transfer(const uint8_t *txbuf, uint8_t *rxbuf, int len)
 
 	spi_message_add_tail(&transfer, &msg);
 
-	err = spi_sync(pisnd_spi_device, &msg);
+	err = spi_sync(pisnd->spi, &msg);
 
 	if (err < 0) {
 		printe("spi_sync error %d\n", err);
 		return;
 	}
 
-	printd("hasMore %d\n", pisnd_spi_has_more());
+	if (pisnd->capture)
+		pisnd_capture_frames(pisnd, txbuf, rxbuf, len);
+
+	printd("hasMore %d\n", pisnd_spi_has_more(pisnd));
 }
 
-static int spi_read_bytes(char *dst, size_t length, uint8_t *bytesRead)
+/* Reads count 16 bit frames in a single transfer. Every frame of the info
+ * block must have its high byte set.
+ */
+static int spi_read_frames(
+	struct pisnd *pisnd,
+	const uint8_t *txbuf,
+	uint8_t *rxbuf,
+	unsigned int count
+	)
 {
-	uint16_t rx;
-	uint8_t size;
-	uint8_t i;
+	unsigned int i;
 
-	memset(dst, 0, length);
-	*bytesRead = 0;
+	spi_transfer(pisnd, txbuf, rxbuf, count * 2);
 
-	rx = spi_transfer16(0);
-	if (!(rx >> 8))
-		return -EINVAL;
+	for (i = 0; i < count; ++i)
+		if (!rxbuf[i * 2])
+			return -EINVAL;
+
+	return 0;
+}
 
-	size = rx & 0xff;
+enum { TRANSFER_SIZE = 4 };
 
-	if (size > length)
-		return -EINVAL;
+/* Used while SysEx is going through. */
+enum { BULK_TRANSFER_SIZE = 64 };
+enum { BULK_MAX_SLEEP_US = 2000 };
 
-	for (i = 0; i < size; ++i) {
-		rx = spi_transfer16(0);
-		if (!(rx >> 8))
-			return -EINVAL;
+enum { PISOUND_OUTPUT_BUFFER_SIZE_MILLIBYTES = 127 * 1000 };
+enum { MIDI_MILLIBYTES_PER_MS = 3125 };
 
-		dst[i] = rx & 0xff;
+/* Credit flow control, firmware 2.00 and later. Once enabled with the
+ * tx frame 0xc001, the firmware reports the free space in its MIDI output
+ * buffer in rx frames of 0xc0 <free bytes>, in place of an input byte.
+ * The count covers the output bytes of all the frames before it.
+ */
+enum { PISND_FW_VERSION_CREDITS = 0x0200 };
+enum { PISND_TX_ENABLE_CREDITS = 0xc001 };
+enum { PISND_RX_CREDITS = 0xc0 };
+
+/* The command isn't acknowledged, the first report confirms it. Until
+ * then, and whenever output is held up by no credits, a report has to
+ * arrive within this many transfers or milliseconds, otherwise the
+ * buffer usage goes back to being estimated.
+ */
+enum { PISND_CREDIT_TIMEOUT_TRANSFERS = 64 };
+enum { PISND_CREDIT_TIMEOUT_MS = 10 };
+
+/* Decides whether the worker may clock more frames out of the firmware.
+ * With nobody reading, input is kept flowing and dropped, as before, so
+ * that MIDI output isn't held up by an unopened input port.
+ */
+static bool pisnd_spi_in_throttled(struct pisnd *pisnd)
+{
+	unsigned int len = kfifo_len(&pisnd->spi_fifo_in);
+
+	if (!pisnd->recv_callback) {
+		pisnd->in_throttled = false;
+		return false;
 	}
 
-	*bytesRead = i;
+	if (pisnd->in_throttled) {
+		if (len > pisnd->in_low_watermark)
+			return true;
 
-	return 0;
+		printd("input resumed at %u bytes\n", len);
+		pisnd->in_throttled = false;
+		return false;
+	}
+
+	if (len >= pisnd->in_high_watermark ||
+		kfifo_avail(&pisnd->spi_fifo_in) < BULK_TRANSFER_SIZE / 2) {
+		printd("input throttled at %u bytes\n", len);
+		pisnd->in_throttled = true;
+		++pisnd->in_throttle_count;
+		return true;
+	}
+
+	return false;
 }
 
-static int spi_device_match(struct device *dev, const void *data)
+static bool pisnd_spi_out_pending(struct pisnd *pisnd)
 {
-	struct spi_device *spi = container_of(dev, struct spi_device, dev);
+	return !kfifo_is_empty(&pisnd->spi_fifo_out) ||
+		pisnd->led_flash_duration_changed ||
+		(pisnd->midi_output_substream &&
+		!snd_rawmidi_transmit_empty(pisnd->midi_output_substream));
+}
 
-	printd("      %s %s %dkHz %d bits mode=0x%02X\n",
-		spi->modalias, dev_name(dev), spi->max_speed_hz/1000,
-		spi->bits_per_word, spi->mode);
+static void pisnd_sysex_track(struct pisnd_sysex_stats *stats, uint8_t byte)
+{
+	/* Realtime messages may be interleaved with SysEx. */
+	if (byte >= 0xf8)
+		return;
 
-	if (strcmp("pisound-spi", spi->modalias) == 0) {
-		printi("\tFound!\n");
-		return 1;
+	if (byte == 0xf0) {
+		stats->active = true;
+		stats->bytes = 0;
+		stats->started_at = ktime_get();
 	}
 
-	printe("\tNot found!\n");
-	return 0;
+	if (!stats->active)
+		return;
+
+	++stats->bytes;
+	++stats->total_bytes;
+	stats->last_byte_at = ktime_get();
+
+	/* Ended by F7, or cut short by any other status byte. */
+	if ((byte & 0x80) && byte != 0xf0) {
+		stats->active = false;
+		stats->ended_at = ktime_get();
+		++stats->messages;
+	}
 }
 
-static struct spi_device *pisnd_spi_find_device(void)
+/* A message that never ends, say, with the cable pulled half way
+ * through, is given up on after this long without any of its bytes.
+ */
+enum { PISND_SYSEX_TIMEOUT_MS = 500 };
+
+static void pisnd_sysex_expire(struct pisnd_sysex_stats *stats)
 {
-	struct device *dev;
+	if (!stats->active ||
+		ktime_ms_delta(ktime_get(), stats->last_byte_at) <
+		PISND_SYSEX_TIMEOUT_MS)
+		return;
 
-	printi("Searching for spi device...\n");
-	dev = bus_find_device(&spi_bus_type, NULL, NULL, spi_device_match);
-	if (dev != NULL)
-		return container_of(dev, struct spi_device, dev);
-	else
-		return NULL;
+	printd("SysEx timed out after %llu bytes\n", stats->bytes);
+	stats->active = false;
+	stats->ended_at = stats->last_byte_at;
+}
+
+static bool pisnd_sysex_bulk(struct pisnd *pisnd)
+{
+	pisnd_sysex_expire(&pisnd->sysex_out);
+	pisnd_sysex_expire(&pisnd->sysex_in);
+
+	return (pisnd->sysex_out.active &&
+		!kfifo_is_empty(&pisnd->spi_fifo_out)) ||
+		pisnd->sysex_in.active;
+}
+
+/* Estimate the Pisound's MIDI output buffer usage, so that we don't
+ * overflow it. Space in the buffer should be becoming available at the
+ * UART MIDI byte transfer rate.
+ */
+static void pisnd_update_out_estimate(
+	int *out_buffer_used_millibytes,
+	ktime_t *last_transfer_at
+	)
+{
+	ktime_t now = ktime_get();
+	s64 elapsed_us = ktime_us_delta(now, *last_transfer_at);
+
+	if (elapsed_us <= 0)
+		return;
+
+	*out_buffer_used_millibytes -= min_t(s64,
+		div_s64(elapsed_us * MIDI_MILLIBYTES_PER_MS, 1000),
+		*out_buffer_used_millibytes);
+	*last_transfer_at = now;
+}
+
+/* Called after every transfer while credits are enabled. Falls back to
+ * estimating if the firmware stops reporting while we depend on it,
+ * before the handshake, or with output waiting for credits, so the worker
+ * loop can't keep spinning for them.
+ */
+static void pisnd_check_credits(
+	struct pisnd *pisnd,
+	bool reported,
+	int *out_buffer_used_millibytes
+	)
+{
+	bool waiting;
+
+	if (reported) {
+		if (!pisnd->credits_confirmed)
+			printi("Using credit based MIDI output flow control\n");
+		WRITE_ONCE(pisnd->credits_confirmed, true);
+		pisnd->credit_wait_transfers = 0;
+		return;
+	}
+
+	waiting = !pisnd->credits_confirmed ||
+		(pisnd->out_credits <= 0 &&
+		!kfifo_is_empty(&pisnd->spi_fifo_out));
+
+	if (!waiting) {
+		pisnd->credit_wait_transfers = 0;
+		return;
+	}
+
+	if (pisnd->credit_wait_transfers++ == 0)
+		pisnd->credit_wait_since = ktime_get();
+
+	if (pisnd->credit_wait_transfers < PISND_CREDIT_TIMEOUT_TRANSFERS &&
+		ktime_ms_delta(ktime_get(), pisnd->credit_wait_since) <
+		PISND_CREDIT_TIMEOUT_MS)
+		return;
+
+	printe("No MIDI output credits reported in %u transfers, falling back to estimating\n",
+		pisnd->credit_wait_transfers);
+
+	/* Nothing was estimated while the credits were in use, assume the
+	 * buffer is full.
+	 */
+	if (pisnd->credits_confirmed)
+		*out_buffer_used_millibytes =
+			PISOUND_OUTPUT_BUFFER_SIZE_MILLIBYTES;
+
+	WRITE_ONCE(pisnd->credits_confirmed, false);
+	WRITE_ONCE(pisnd->credits_enabled, false);
+	pisnd->credit_wait_transfers = 0;
+}
+
+/* Room in the Pisound's MIDI output buffer, as reported by the firmware,
+ * or otherwise estimated.
+ */
+static int pisnd_out_room_millibytes(
+	struct pisnd *pisnd,
+	int out_buffer_used_millibytes
+	)
+{
+	if (pisnd->credits_confirmed)
+		return pisnd->out_credits * 1000;
+
+	return PISOUND_OUTPUT_BUFFER_SIZE_MILLIBYTES -
+		out_buffer_used_millibytes - 1;
 }
 
 static void pisnd_work_handler(struct work_struct *work)
 {
-	enum { TRANSFER_SIZE = 4 };
-	enum { PISOUND_OUTPUT_BUFFER_SIZE_MILLIBYTES = 127 * 1000 };
-	enum { MIDI_MILLIBYTES_PER_JIFFIE = (3125 * 1000) / HZ };
+	struct pisnd *pisnd = container_of(work, struct pisnd, work_process);
 	int out_buffer_used_millibytes = 0;
-	unsigned long now;
+	int room, room_needed;
+	int sent;
+	bool reported;
+	ktime_t last_transfer_at = ktime_get();
 	uint8_t val;
-	uint8_t txbuf[TRANSFER_SIZE];
-	uint8_t rxbuf[TRANSFER_SIZE];
-	uint8_t midibuf[TRANSFER_SIZE];
+	uint8_t *txbuf = pisnd->txbuf;
+	uint8_t *rxbuf = pisnd->rxbuf;
+	uint8_t *midibuf = pisnd->midibuf;
+	unsigned int size;
+	unsigned long sleep_us;
 	int i, n;
 	bool had_data;
+	bool bulk;
 
-	unsigned long last_transfer_at = jiffies;
+	if (pisnd->spi == NULL)
+		return;
 
-	if (work == &pisnd_work_process) {
-		if (pisnd_spi_device == NULL)
-			return;
+	WRITE_ONCE(pisnd->last_work_cpu, raw_smp_processor_id());
+
+	do {
+		bulk = pisnd_sysex_bulk(pisnd);
+		size = bulk ? BULK_TRANSFER_SIZE : TRANSFER_SIZE;
+
+		/* While throttled, the firmware holds on to the input bytes
+		 * and keeps data_available asserted. Reading from the rawmidi
+		 * device triggers the input, which schedules us again. Output
+		 * may still go out, while the headroom above the high
+		 * watermark can take whatever comes back with it.
+		 */
+		if (pisnd_spi_in_throttled(pisnd)) {
+			if (pisnd->recv_callback)
+				pisnd->recv_callback(pisnd->recv_data);
+			if (pisnd_spi_in_throttled(pisnd)) {
+				if (!pisnd_spi_out_pending(pisnd) ||
+					kfifo_avail(&pisnd->spi_fifo_in) <
+					TRANSFER_SIZE / 2)
+					return;
+				size = TRANSFER_SIZE;
+			}
+		}
 
-		do {
-			if (g_midi_output_substream &&
-				kfifo_avail(&spi_fifo_out) >= sizeof(midibuf)) {
+		if (pisnd->midi_output_substream &&
+			kfifo_avail(&pisnd->spi_fifo_out) >= size) {
 
-				n = snd_rawmidi_transmit_peek(
-					g_midi_output_substream,
-					midibuf, sizeof(midibuf)
-				);
+			n = snd_rawmidi_transmit_peek(
+				pisnd->midi_output_substream,
+				midibuf, size
+			);
 
-				if (n > 0) {
-					for (i = 0; i < n; ++i)
-						kfifo_put(
-							&spi_fifo_out,
-							midibuf[i]
-							);
-					snd_rawmidi_transmit_ack(
-						g_midi_output_substream,
-						i
+			if (n > 0) {
+				for (i = 0; i < n; ++i)
+					kfifo_put(
+						&pisnd->spi_fifo_out,
+						midibuf[i]
 						);
-				}
+				snd_rawmidi_transmit_ack(
+					pisnd->midi_output_substream,
+					i
+					);
 			}
+		}
 
-			had_data = false;
-			memset(txbuf, 0, sizeof(txbuf));
-			for (i = 0; i < sizeof(txbuf) &&
-				((out_buffer_used_millibytes+1000 <
-				PISOUND_OUTPUT_BUFFER_SIZE_MILLIBYTES) ||
-				g_ledFlashDurationChanged);
-				i += 2) {
-
-				val = 0;
-
-				if (g_ledFlashDurationChanged) {
-					txbuf[i+0] = 0xf0;
-					txbuf[i+1] = g_ledFlashDuration;
-					g_ledFlashDuration = 0;
-					g_ledFlashDurationChanged = false;
-				} else if (kfifo_get(&spi_fifo_out, &val)) {
-					txbuf[i+0] = 0x0f;
-					txbuf[i+1] = val;
-					out_buffer_used_millibytes += 1000;
-				}
+		/* In bulk mode, rather than spinning on transfers that can't
+		 * carry any output until the UART drains, sleep until there's
+		 * room for a whole transfer worth of bytes, a bit at a time,
+		 * so incoming data isn't held up for long.
+		 */
+		if (bulk && !kfifo_is_empty(&pisnd->spi_fifo_out) &&
+			!pisnd->led_flash_duration_changed &&
+			!pisnd_spi_has_more(pisnd)) {
+			room_needed = min_t(unsigned int,
+				kfifo_len(&pisnd->spi_fifo_out), size / 2) * 1000;
+			room_needed -= pisnd_out_room_millibytes(
+				pisnd,
+				out_buffer_used_millibytes
+				);
+			if (room_needed > 0) {
+				sleep_us = min_t(unsigned long,
+					room_needed * 1000 / MIDI_MILLIBYTES_PER_MS,
+					BULK_MAX_SLEEP_US);
+				usleep_range(sleep_us, sleep_us + 50);
+				pisnd_update_out_estimate(
+					&out_buffer_used_millibytes,
+					&last_transfer_at
+					);
 			}
+		}
 
-			spi_transfer(txbuf, rxbuf, sizeof(txbuf));
-			/* Estimate the Pisound's MIDI output buffer usage, so
-			 * that we don't overflow it. Space in the buffer should
-			 * be becoming available at the UART MIDI byte transfer
-			 * rate.
-			 */
-			now = jiffies;
-			if (now != last_transfer_at) {
-				out_buffer_used_millibytes -=
-					(now - last_transfer_at) *
-					MIDI_MILLIBYTES_PER_JIFFIE;
-				if (out_buffer_used_millibytes < 0)
-					out_buffer_used_millibytes = 0;
-				last_transfer_at = now;
+		had_data = false;
+		sent = 0;
+		room = pisnd_out_room_millibytes(
+			pisnd,
+			out_buffer_used_millibytes
+			);
+		memset(txbuf, 0, size);
+		for (i = 0; i < size &&
+			(room >= 1000 || pisnd->led_flash_duration_changed);
+			i += 2) {
+
+			val = 0;
+
+			if (pisnd->led_flash_duration_changed) {
+				txbuf[i+0] = 0xf0;
+				txbuf[i+1] = pisnd->led_flash_duration;
+				pisnd->led_flash_duration = 0;
+				pisnd->led_flash_duration_changed = false;
+			} else if (kfifo_get(&pisnd->spi_fifo_out, &val)) {
+				txbuf[i+0] = 0x0f;
+				txbuf[i+1] = val;
+				room -= 1000;
+				++sent;
+				if (pisnd->credits_confirmed)
+					--pisnd->out_credits;
+				else
+					out_buffer_used_millibytes += 1000;
+				pisnd_sysex_track(&pisnd->sysex_out, val);
 			}
+		}
 
-			for (i = 0; i < sizeof(rxbuf); i += 2) {
-				if (rxbuf[i]) {
-					kfifo_put(&spi_fifo_in, rxbuf[i+1]);
-					if (kfifo_len(&spi_fifo_in) > 16 &&
-						g_recvCallback)
-						g_recvCallback(g_recvData);
-					had_data = true;
-				}
-			}
-		} while (had_data
-			|| !kfifo_is_empty(&spi_fifo_out)
-			|| pisnd_spi_has_more()
-			|| g_ledFlashDurationChanged
-			|| out_buffer_used_millibytes != 0
+		spi_transfer(pisnd, txbuf, rxbuf, size);
+
+		pisnd_update_out_estimate(
+			&out_buffer_used_millibytes,
+			&last_transfer_at
 			);
 
-		if (!kfifo_is_empty(&spi_fifo_in) && g_recvCallback)
-			g_recvCallback(g_recvData);
-	}
+		reported = false;
+		for (i = 0; i < size; i += 2) {
+			if (pisnd->credits_enabled &&
+				rxbuf[i] == PISND_RX_CREDITS) {
+				/* Bytes sent from this frame on aren't
+				 * accounted for in the report yet.
+				 */
+				pisnd->out_credits = max_t(int,
+					rxbuf[i+1] - sent, 0);
+				++pisnd->credit_frames;
+				reported = true;
+			} else if (rxbuf[i]) {
+				if (!kfifo_put(&pisnd->spi_fifo_in, rxbuf[i+1]))
+					++pisnd->in_dropped;
+				pisnd_sysex_track(&pisnd->sysex_in, rxbuf[i+1]);
+				if (kfifo_len(&pisnd->spi_fifo_in) > 16 &&
+					pisnd->recv_callback)
+					pisnd->recv_callback(pisnd->recv_data);
+				had_data = true;
+			}
+
+			if (txbuf[i] == 0x0f)
+				--sent;
+		}
+
+		if (pisnd->credits_enabled)
+			pisnd_check_credits(
+				pisnd,
+				reported,
+				&out_buffer_used_millibytes
+				);
+	} while (had_data
+		|| !kfifo_is_empty(&pisnd->spi_fifo_out)
+		|| pisnd_spi_has_more(pisnd)
+		|| pisnd->led_flash_duration_changed
+		|| out_buffer_used_millibytes != 0
+		);
+
+	if (!kfifo_is_empty(&pisnd->spi_fifo_in) && pisnd->recv_callback)
+		pisnd->recv_callback(pisnd->recv_data);
 }
 
-static int pisnd_spi_gpio_init(struct device *dev)
+static int pisnd_spi_gpio_init(struct pisnd *pisnd, struct device *dev)
 {
-	spi_reset = gpiod_get_index(dev, "reset", 1, GPIOD_ASIS);
-	data_available = gpiod_get_index(dev, "data_available", 0, GPIOD_ASIS);
+	pisnd->spi_reset = gpiod_get_index(dev, "reset", 1, GPIOD_ASIS);
+	pisnd->data_available = gpiod_get_index(
+		dev,
+		"data_available",
+		0,
+		GPIOD_ASIS
+		);
 
-	gpiod_direction_output(spi_reset, 1);
-	gpiod_direction_input(data_available);
+	gpiod_direction_output(pisnd->spi_reset, 1);
+	gpiod_direction_input(pisnd->data_available);
 
 	/* Reset the slave. */
-	gpiod_set_value(spi_reset, false);
-	mdelay(1);
-	gpiod_set_value(spi_reset, true);
+	gpiod_set_value(pisnd->spi_reset, false);
+	usleep_range(1000, 2000);
+	gpiod_set_value(pisnd->spi_reset, true);
 
-	/* Give time for spi slave to start. */
-	mdelay(64);
+	/* Give time for spi slave to start. Probing is asynchronous, so
+	 * sleeping here doesn't hold up the rest of the boot.
+	 */
+	msleep(64);
 
 	return 0;
 }
 
-static void pisnd_spi_gpio_uninit(void)
+static void pisnd_spi_gpio_uninit(struct pisnd *pisnd)
 {
-	gpiod_set_value(spi_reset, false);
-	gpiod_put(spi_reset);
-	spi_reset = NULL;
+	gpiod_set_value(pisnd->spi_reset, false);
+	gpiod_put(pisnd->spi_reset);
+	pisnd->spi_reset = NULL;
 
-	gpiod_put(data_available);
-	data_available = NULL;
+	gpiod_put(pisnd->data_available);
+	pisnd->data_available = NULL;
 }
 
-static int pisnd_spi_gpio_irq_init(struct device *dev)
+static int pisnd_spi_gpio_irq_init(struct pisnd *pisnd)
 {
 	return request_threaded_irq(
-		gpiod_to_irq(data_available), NULL,
+		gpiod_to_irq(pisnd->data_available), NULL,
 		data_available_interrupt_handler,
 		IRQF_TIMER | IRQF_TRIGGER_RISING | IRQF_ONESHOT,
 		"data_available_int",
-		NULL
+		pisnd
 		);
 }
 
-static void pisnd_spi_gpio_irq_uninit(void)
+static void pisnd_spi_gpio_irq_uninit(struct pisnd *pisnd)
 {
-	free_irq(gpiod_to_irq(data_available), NULL);
+	int irq = gpiod_to_irq(pisnd->data_available);
+
+	irq_set_affinity_and_hint(irq, NULL);
+	free_irq(irq, pisnd);
 }
 
-static int spi_read_info(void)
+/* Routes the SPI interrupt to the given CPUs, and the worker to the
+ * first online one of them, an empty mask lets them run anywhere.
+ */
+static int pisnd_set_cpus(struct pisnd *pisnd, const struct cpumask *mask)
 {
-	uint16_t tmp;
-	uint8_t count;
-	uint8_t n;
-	uint8_t i;
-	uint8_t j;
-	char buffer[257];
+	int irq = gpiod_to_irq(pisnd->data_available);
+	int cpu = WORK_CPU_UNBOUND;
 	int ret;
-	char *p;
 
-	memset(g_serial_num, 0, sizeof(g_serial_num));
-	memset(g_fw_version, 0, sizeof(g_fw_version));
-	strcpy(g_hw_version, "1.0"); // Assume 1.0 hw version.
-	memset(g_id, 0, sizeof(g_id));
+	if (!cpumask_empty(mask)) {
+		cpu = cpumask_first_and(mask, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			return -EINVAL;
+	}
 
-	tmp = spi_transfer16(0);
+	ret = irq_set_affinity_and_hint(irq, cpumask_empty(mask) ? NULL : mask);
+	if (ret < 0)
+		return ret;
 
-	if (!(tmp >> 8))
-		return -EINVAL;
+	cpumask_copy(&pisnd->cpus, mask);
+	WRITE_ONCE(pisnd->work_cpu, cpu);
 
-	count = tmp & 0xff;
+	return 0;
+}
 
-	for (i = 0; i < count; ++i) {
-		memset(buffer, 0, sizeof(buffer));
-		ret = spi_read_bytes(buffer, sizeof(buffer)-1, &n);
+static int spi_parse_info(
+	struct pisnd *pisnd,
+	uint8_t index,
+	const uint8_t *buffer,
+	uint8_t n
+	)
+{
+	uint8_t j;
+	char *p;
 
-		if (ret < 0)
-			return ret;
+	switch (index) {
+	case 0:
+		if (n != 2)
+			return -EINVAL;
 
-		switch (i) {
-		case 0:
-			if (n != 2)
-				return -EINVAL;
+		snprintf(
+			pisnd->fw_version,
+			MAX_VERSION_STR_LEN,
+			"%x.%02x",
+			buffer[0],
+			buffer[1]
+			);
+		pisnd->fw_version_code = (buffer[0] << 8) | buffer[1];
 
-			snprintf(
-				g_fw_version,
-				MAX_VERSION_STR_LEN,
-				"%x.%02x",
-				buffer[0],
-				buffer[1]
-				);
+		pisnd->fw_version[MAX_VERSION_STR_LEN-1] = '\0';
+		break;
+	case 3:
+		if (n != 2)
+			return -EINVAL;
 
-			g_fw_version[MAX_VERSION_STR_LEN-1] = '\0';
-			break;
-		case 3:
-			if (n != 2)
-				return -EINVAL;
+		snprintf(
+			pisnd->hw_version,
+			MAX_VERSION_STR_LEN,
+			"%x.%x",
+			buffer[0],
+			buffer[1]
+		);
 
-			snprintf(
-				g_hw_version,
-				MAX_VERSION_STR_LEN,
-				"%x.%x",
-				buffer[0],
-				buffer[1]
-			);
+		pisnd->hw_version[MAX_VERSION_STR_LEN-1] = '\0';
+		break;
+	case 1:
+		if (n >= sizeof(pisnd->serial_num))
+			return -EINVAL;
 
-			g_hw_version[MAX_VERSION_STR_LEN-1] = '\0';
-			break;
-		case 1:
-			if (n >= sizeof(g_serial_num))
+		memcpy(pisnd->serial_num, buffer, n);
+		pisnd->serial_num[n] = '\0';
+		break;
+	case 2:
+		{
+			if (n*2 >= sizeof(pisnd->id))
 				return -EINVAL;
 
-			memcpy(g_serial_num, buffer, sizeof(g_serial_num));
-			break;
-		case 2:
-			{
-				if (n*2 >= sizeof(g_id))
-					return -EINVAL;
-
-				p = g_id;
-				for (j = 0; j < n; ++j)
-					p += sprintf(p, "%02x", buffer[j]);
+			p = pisnd->id;
+			for (j = 0; j < n; ++j)
+				p += sprintf(p, "%02x", buffer[j]);
 
-				*p = '\0';
-			}
-			break;
-		default:
-			break;
+			*p = '\0';
 		}
+		break;
+	default:
+		break;
 	}
 
 	return 0;
 }
 
-static int pisnd_spi_init(struct device *dev)
+/* The info block consists of a count frame, followed by count items, each
+ * made of a size frame and size data frames. Rather than a transfer per
+ * frame, the data of an item and the size of the following one are read
+ * in a single transfer.
+ */
+static int spi_read_info(struct pisnd *pisnd)
 {
+	enum { MAX_FRAMES = 255 + 1 };
+	uint8_t *txbuf;
+	uint8_t *rxbuf;
+	uint8_t buffer[255];
+	uint8_t count;
+	uint8_t size;
+	uint8_t next_size;
+	unsigned int frames;
+	uint8_t i;
+	uint8_t j;
 	int ret;
-	struct spi_device *spi;
 
-	memset(g_serial_num, 0, sizeof(g_serial_num));
-	memset(g_id, 0, sizeof(g_id));
-	memset(g_fw_version, 0, sizeof(g_fw_version));
-	memset(g_hw_version, 0, sizeof(g_hw_version));
+	memset(pisnd->serial_num, 0, sizeof(pisnd->serial_num));
+	memset(pisnd->fw_version, 0, sizeof(pisnd->fw_version));
+	pisnd->fw_version_code = 0;
+	strcpy(pisnd->hw_version, "1.0"); // Assume 1.0 hw version.
+	memset(pisnd->id, 0, sizeof(pisnd->id));
 
-	spi = pisnd_spi_find_device();
+	/* Heap allocated, as SPI buffers must be DMA safe. */
+	txbuf = kzalloc(MAX_FRAMES * 2 * 2, GFP_KERNEL);
+	if (!txbuf)
+		return -ENOMEM;
+	rxbuf = txbuf + MAX_FRAMES * 2;
 
-	if (spi != NULL) {
-		printd("initializing spi!\n");
-		pisnd_spi_device = spi;
-		ret = spi_setup(pisnd_spi_device);
-	} else {
-		printe("SPI device not found, deferring!\n");
-		return -EPROBE_DEFER;
-	}
+	ret = spi_read_frames(pisnd, txbuf, rxbuf, 1);
+	if (ret < 0)
+		goto out;
 
-	ret = pisnd_spi_gpio_init(dev);
+	count = rxbuf[1];
+	if (count == 0)
+		goto out;
 
-	if (ret < 0) {
-		printe("SPI GPIO init failed: %d\n", ret);
-		spi_dev_put(pisnd_spi_device);
-		pisnd_spi_device = NULL;
-		pisnd_spi_gpio_uninit();
-		return ret;
-	}
+	ret = spi_read_frames(pisnd, txbuf, rxbuf, 1);
+	if (ret < 0)
+		goto out;
 
-	ret = spi_read_info();
+	size = rxbuf[1];
 
-	if (ret < 0) {
-		printe("Reading card info failed: %d\n", ret);
-		spi_dev_put(pisnd_spi_device);
-		pisnd_spi_device = NULL;
-		pisnd_spi_gpio_uninit();
-		return ret;
-	}
+	for (i = 0; i < count; ++i) {
+		frames = size + (i + 1 < count ? 1 : 0);
+		next_size = 0;
 
-	/* Flash the LEDs. */
-	spi_transfer16(0xf008);
+		if (frames != 0) {
+			ret = spi_read_frames(pisnd, txbuf, rxbuf, frames);
+			if (ret < 0)
+				goto out;
+		}
 
-	ret = pisnd_spi_gpio_irq_init(dev);
-	if (ret < 0) {
-		printe("SPI irq request failed: %d\n", ret);
-		spi_dev_put(pisnd_spi_device);
-		pisnd_spi_device = NULL;
-		pisnd_spi_gpio_irq_uninit();
-		pisnd_spi_gpio_uninit();
-	}
+		for (j = 0; j < size; ++j)
+			buffer[j] = rxbuf[j * 2 + 1];
 
-	ret = pisnd_init_workqueues();
-	if (ret != 0) {
-		printe("Workqueue initialization failed: %d\n", ret);
-		spi_dev_put(pisnd_spi_device);
-		pisnd_spi_device = NULL;
-		pisnd_spi_gpio_irq_uninit();
-		pisnd_spi_gpio_uninit();
-		pisnd_uninit_workqueues();
-		return ret;
-	}
+		if (i + 1 < count)
+			next_size = rxbuf[size * 2 + 1];
 
-	if (pisnd_spi_has_more()) {
-		printd("data is available, scheduling from init\n");
-		pisnd_schedule_process(TASK_PROCESS);
+		ret = spi_parse_info(pisnd, i, buffer, size);
+		if (ret < 0)
+			goto out;
+
+		size = next_size;
 	}
 
-	return 0;
+out:
+	kfree(txbuf);
+	return ret;
 }
 
-static void pisnd_spi_uninit(void)
+/* Older firmware doesn't know the command, and its output buffer usage
+ * keeps being estimated from the time passed. The estimate is also used
+ * until the first report arrives with the following transfers, and again
+ * if the reports stop, see pisnd_check_credits.
+ */
+static void pisnd_enable_credits(struct pisnd *pisnd)
 {
-	pisnd_uninit_workqueues();
-
-	spi_dev_put(pisnd_spi_device);
-	pisnd_spi_device = NULL;
+	pisnd->credits_enabled = false;
+	pisnd->credits_confirmed = false;
+	pisnd->out_credits = 0;
+	pisnd->credit_frames = 0;
+	pisnd->credit_wait_transfers = 0;
+
+	if (!credit_flow ||
+		pisnd->fw_version_code < PISND_FW_VERSION_CREDITS)
+		return;
 
-	pisnd_spi_gpio_irq_uninit();
-	pisnd_spi_gpio_uninit();
+	spi_transfer16(pisnd, PISND_TX_ENABLE_CREDITS);
+	pisnd->credits_enabled = true;
+	printi("Requested credit based MIDI output flow control\n");
 }
 
-static void pisnd_spi_flash_leds(uint8_t duration)
+static int pisnd_init_fifos(struct pisnd *pisnd)
 {
-	g_ledFlashDuration = duration;
-	g_ledFlashDurationChanged = true;
-	printd("schedule from spi_flash_leds\n");
-	pisnd_schedule_process(TASK_PROCESS);
-}
+	unsigned int size, high, low;
+	int ret;
 
-static void pisnd_spi_flush(void)
-{
-	while (!kfifo_is_empty(&spi_fifo_out)) {
-		pisnd_spi_start();
-		flush_workqueue(pisnd_workqueue);
-	}
-}
+	ret = kfifo_alloc(&pisnd->spi_fifo_in,
+		max_t(unsigned int, fifo_in_size, MIN_FIFO_SIZE), GFP_KERNEL);
+	if (ret < 0)
+		return ret;
 
-static void pisnd_spi_start(void)
-{
+	ret = kfifo_alloc(&pisnd->spi_fifo_out,
+		max_t(unsigned int, fifo_out_size, MIN_FIFO_SIZE), GFP_KERNEL);
+	if (ret < 0) {
+		kfifo_free(&pisnd->spi_fifo_in);
+		return ret;
+	}
+
+	/* The high watermark must leave room for a whole transfer, as
+	 * every frame clocked out may carry an input byte.
+	 */
+	size = kfifo_size(&pisnd->spi_fifo_in);
+	high = clamp_t(unsigned int, size * fifo_in_high_watermark / 100,
+		1, size - BULK_TRANSFER_SIZE / 2);
+	low = min_t(unsigned int, size * fifo_in_low_watermark / 100,
+		high - 1);
+
+	pisnd->in_high_watermark = high;
+	pisnd->in_low_watermark = low;
+	pisnd->in_throttled = false;
+
+	return 0;
+}
+
+static void pisnd_uninit_fifos(struct pisnd *pisnd)
+{
+	kfifo_free(&pisnd->spi_fifo_out);
+	kfifo_free(&pisnd->spi_fifo_in);
+
+	kvfree(pisnd->capture);
+	pisnd->capture = NULL;
+}
+
+/* Not fatal, the capture is a debugging aid only. */
+static void pisnd_init_capture(struct pisnd *pisnd)
+{
+	spin_lock_init(&pisnd->capture_lock);
+	pisnd->capture_head = 0;
+	pisnd->capture_count = 0;
+	pisnd->capture_transfer = 0;
+	pisnd->capture_size = capture_frames;
+
+	if (capture_frames == 0)
+		return;
+
+	pisnd->capture = kvcalloc(
+		capture_frames,
+		sizeof(*pisnd->capture),
+		GFP_KERNEL
+		);
+	if (!pisnd->capture)
+		printe("Failed to allocate %u capture frames\n", capture_frames);
+}
+
+/* Expects pisnd->spi to have been provided by the bound SPI component. */
+static int pisnd_spi_init(struct pisnd *pisnd, struct device *dev)
+{
+	int ret;
+
+	memset(pisnd->serial_num, 0, sizeof(pisnd->serial_num));
+	memset(pisnd->id, 0, sizeof(pisnd->id));
+	memset(pisnd->fw_version, 0, sizeof(pisnd->fw_version));
+	memset(pisnd->hw_version, 0, sizeof(pisnd->hw_version));
+
+	pisnd->txbuf = devm_kmalloc(dev, BULK_TRANSFER_SIZE * 3, GFP_KERNEL);
+	if (!pisnd->txbuf)
+		return -ENOMEM;
+	pisnd->rxbuf = pisnd->txbuf + BULK_TRANSFER_SIZE;
+	pisnd->midibuf = pisnd->rxbuf + BULK_TRANSFER_SIZE;
+
+	ret = pisnd_init_fifos(pisnd);
+	if (ret < 0) {
+		printe("FIFO allocation failed: %d\n", ret);
+		return ret;
+	}
+
+	/* Set up before reading the info, so it gets captured too. */
+	pisnd_init_capture(pisnd);
+
+	ret = pisnd_spi_gpio_init(pisnd, dev);
+
+	if (ret < 0) {
+		printe("SPI GPIO init failed: %d\n", ret);
+		pisnd_spi_gpio_uninit(pisnd);
+		pisnd_uninit_fifos(pisnd);
+		return ret;
+	}
+
+	ret = spi_read_info(pisnd);
+
+	if (ret < 0) {
+		printe("Reading card info failed: %d\n", ret);
+		pisnd_spi_gpio_uninit(pisnd);
+		pisnd_uninit_fifos(pisnd);
+		return ret;
+	}
+
+	pisnd_enable_credits(pisnd);
+
+	/* Flash the LEDs. */
+	spi_transfer16(pisnd, 0xf008);
+
+	ret = pisnd_init_workqueues(pisnd);
+	if (ret != 0) {
+		printe("Workqueue initialization failed: %d\n", ret);
+		pisnd_spi_gpio_uninit(pisnd);
+		pisnd_uninit_fifos(pisnd);
+		return ret;
+	}
+
+	pisnd->work_cpu = WORK_CPU_UNBOUND;
+	pisnd->last_irq_cpu = -1;
+	pisnd->last_work_cpu = -1;
+
+	ret = pisnd_spi_gpio_irq_init(pisnd);
+	if (ret < 0) {
+		printe("SPI irq request failed: %d\n", ret);
+		pisnd_uninit_workqueues(pisnd);
+		pisnd_spi_gpio_uninit(pisnd);
+		pisnd_uninit_fifos(pisnd);
+		return ret;
+	}
+
+	if (cpus && *cpus) {
+		cpumask_var_t mask;
+
+		if (!zalloc_cpumask_var(&mask, GFP_KERNEL)) {
+			ret = -ENOMEM;
+		} else {
+			ret = cpulist_parse(cpus, mask);
+			if (ret == 0)
+				ret = pisnd_set_cpus(pisnd, mask);
+			free_cpumask_var(mask);
+		}
+
+		/* Not fatal, the defaults work, just without the pinning. */
+		if (ret < 0)
+			printe("Failed to apply cpus=%s: %d\n", cpus, ret);
+	}
+
+	if (pisnd_spi_has_more(pisnd)) {
+		printd("data is available, scheduling from init\n");
+		pisnd_schedule_process(pisnd, TASK_PROCESS);
+	}
+
+	return 0;
+}
+
+static void pisnd_spi_uninit(struct pisnd *pisnd)
+{
+	pisnd_spi_gpio_irq_uninit(pisnd);
+	pisnd_uninit_workqueues(pisnd);
+
+	pisnd_spi_gpio_uninit(pisnd);
+	pisnd_uninit_fifos(pisnd);
+}
+
+static void pisnd_spi_flash_leds(struct pisnd *pisnd, uint8_t duration)
+{
+	pisnd->led_flash_duration = duration;
+	pisnd->led_flash_duration_changed = true;
+	printd("schedule from spi_flash_leds\n");
+	pisnd_schedule_process(pisnd, TASK_PROCESS);
+}
+
+static void pisnd_spi_flush(struct pisnd *pisnd)
+{
+	while (!kfifo_is_empty(&pisnd->spi_fifo_out)) {
+		pisnd_spi_start(pisnd);
+		flush_workqueue(pisnd->workqueue);
+
+		/* Output is stuck behind unread input, leave the rest queued
+		 * rather than spinning until the application reads.
+		 */
+		if (pisnd->in_throttled &&
+			kfifo_avail(&pisnd->spi_fifo_in) < TRANSFER_SIZE / 2)
+			break;
+	}
+}
+
+static void pisnd_spi_start(struct pisnd *pisnd)
+{
 	printd("schedule from spi_start\n");
-	pisnd_schedule_process(TASK_PROCESS);
+	pisnd_schedule_process(pisnd, TASK_PROCESS);
+}
+
+static unsigned int pisnd_spi_peek(
+	struct pisnd *pisnd,
+	uint8_t *buffer,
+	unsigned int length
+	)
+{
+	return kfifo_out_peek(&pisnd->spi_fifo_in, buffer, length);
 }
 
-static uint8_t pisnd_spi_recv(uint8_t *buffer, uint8_t length)
+static void pisnd_spi_consume(struct pisnd *pisnd, unsigned int length)
 {
-	return kfifo_out(&spi_fifo_in, buffer, length);
+	while (length--)
+		kfifo_skip(&pisnd->spi_fifo_in);
 }
 
-static void pisnd_spi_set_callback(pisnd_spi_recv_cb cb, void *data)
+static void pisnd_spi_set_callback(
+	struct pisnd *pisnd,
+	pisnd_spi_recv_cb cb,
+	void *data
+	)
 {
-	g_recvData = data;
-	g_recvCallback = cb;
+	pisnd->recv_data = data;
+	pisnd->recv_callback = cb;
 }
 
-static const char *pisnd_spi_get_serial(void)
+static const char *pisnd_spi_get_serial(struct pisnd *pisnd)
 {
-	return g_serial_num;
+	return pisnd->serial_num;
 }
 
-static const char *pisnd_spi_get_id(void)
+static const char *pisnd_spi_get_id(struct pisnd *pisnd)
 {
-	return g_id;
+	return pisnd->id;
 }
 
-static const char *pisnd_spi_get_fw_version(void)
+static const char *pisnd_spi_get_fw_version(struct pisnd *pisnd)
 {
-	return g_fw_version;
+	return pisnd->fw_version;
 }
 
-static const char *pisnd_spi_get_hw_version(void)
+static const char *pisnd_spi_get_hw_version(struct pisnd *pisnd)
 {
-	return g_hw_version;
+	return pisnd->hw_version;
 }
 
 static const struct of_device_id pisound_of_match[] = {
 	{ .compatible = "blokaslabs,pisound", },
-	{ .compatible = "blokaslabs,pisound-spi", },
 	{},
 };
 
@@ -855,9 +1646,50 @@ static int pisnd_ctl_uninit(void)
 	return 0;
 }
 
-static struct gpio_desc *osr0, *osr1, *osr2;
-static struct gpio_desc *reset;
-static struct gpio_desc *button;
+/* Clocks the ADC for the given rate. The ADC must be held in reset while
+ * the OSR lines change, and needs to re-lock afterwards, so that's only
+ * done if the rate actually differs from the one already set up.
+ */
+static int pisnd_set_rate(struct pisnd *pisnd, unsigned int rate)
+{
+	DECLARE_BITMAP(values, 3);
+
+	if (rate == pisnd->rate) {
+		++pisnd->adc_reset_skips;
+		return 0;
+	}
+
+	switch (rate) {
+	case 48000:
+		values[0] = 0x1; /* osr0 */
+		break;
+	case 96000:
+		values[0] = 0x5; /* osr0, osr2 */
+		break;
+	case 192000:
+		values[0] = 0x7; /* osr0, osr1, osr2 */
+		break;
+	default:
+		printe("Unsupported rate %u!\n", rate);
+		return -EINVAL;
+	}
+
+	gpiod_set_value(pisnd->reset, false);
+
+	gpiod_set_array_value(
+		pisnd->osr->ndescs,
+		pisnd->osr->desc,
+		pisnd->osr->info,
+		values
+		);
+
+	gpiod_set_value(pisnd->reset, true);
+
+	pisnd->rate = rate;
+	++pisnd->adc_resets;
+
+	return 0;
+}
 
 static int pisnd_hw_params(
 	struct snd_pcm_substream *substream,
@@ -866,6 +1698,8 @@ static int pisnd_hw_params(
 {
 	struct snd_soc_pcm_runtime *rtd = substream->private_data;
 	struct snd_soc_dai *cpu_dai = asoc_rtd_to_cpu(rtd, 0);
+	struct pisnd *pisnd = snd_soc_card_get_drvdata(rtd->card);
+	int ret;
 
 	/* Pisound runs on fixed 32 clock counts per channel,
 	 * as generated by the master ADC.
@@ -878,31 +1712,98 @@ static int pisnd_hw_params(
 		snd_pcm_format_physical_width(params_format(params)));
 	printd("format = %d\n", params_format(params));
 
-	gpiod_set_value(reset, false);
+	ret = pisnd_set_rate(pisnd, params_rate(params));
 
-	switch (params_rate(params)) {
-	case 48000:
-		gpiod_set_value(osr0, true);
-		gpiod_set_value(osr1, false);
-		gpiod_set_value(osr2, false);
-		break;
-	case 96000:
-		gpiod_set_value(osr0, true);
-		gpiod_set_value(osr1, false);
-		gpiod_set_value(osr2, true);
+	/* The ADC leaves reset as pisnd_set_rate returns, if it was reset. */
+	pisnd->adc_ready_at = ktime_get();
+
+	return ret;
+}
+
+enum { FIRST_CAPTURE_POLL_US = 250 };
+
+/* The hardware pointer only moves on period interrupts, so polling it
+ * tells when the first capture period after the start has completed.
+ */
+static enum hrtimer_restart pisnd_first_capture_timer(struct hrtimer *timer)
+{
+	struct pisnd *pisnd = container_of(
+		timer,
+		struct pisnd,
+		first_capture_timer
+		);
+	struct snd_pcm_substream *substream =
+		READ_ONCE(pisnd->first_capture_substream);
+
+	if (!substream)
+		return HRTIMER_NORESTART;
+
+	if (READ_ONCE(substream->runtime->status->hw_ptr) ==
+		pisnd->first_capture_hw_ptr) {
+		hrtimer_forward_now(timer, us_to_ktime(FIRST_CAPTURE_POLL_US));
+		return HRTIMER_RESTART;
+	}
+
+	WRITE_ONCE(pisnd->first_capture_us,
+		ktime_us_delta(ktime_get(), pisnd->adc_ready_at));
+	pisnd->adc_ready_at = 0;
+	WRITE_ONCE(pisnd->first_capture_substream, NULL);
+
+	return HRTIMER_NORESTART;
+}
+
+static void pisnd_first_capture_stop(struct pisnd *pisnd, bool wait)
+{
+	WRITE_ONCE(pisnd->first_capture_substream, NULL);
+
+	if (wait)
+		hrtimer_cancel(&pisnd->first_capture_timer);
+	else
+		hrtimer_try_to_cancel(&pisnd->first_capture_timer);
+}
+
+static int pisnd_hw_free(struct snd_pcm_substream *substream)
+{
+	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct pisnd *pisnd = snd_soc_card_get_drvdata(rtd->card);
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		pisnd_first_capture_stop(pisnd, true);
+
+	return 0;
+}
+
+static int pisnd_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct pisnd *pisnd = snd_soc_card_get_drvdata(rtd->card);
+
+	if (substream->stream != SNDRV_PCM_STREAM_CAPTURE)
+		return 0;
+
+	/* Measures the time from the ADC leaving reset, or from hw_params
+	 * if no reset was needed, to the first capture period completing
+	 * after the start. Restarts without hw_params aren't measured.
+	 */
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		if (!pisnd->adc_ready_at)
+			break;
+		pisnd->first_capture_hw_ptr = substream->runtime->status->hw_ptr;
+		WRITE_ONCE(pisnd->first_capture_substream, substream);
+		hrtimer_start(
+			&pisnd->first_capture_timer,
+			us_to_ktime(FIRST_CAPTURE_POLL_US),
+			HRTIMER_MODE_REL
+			);
 		break;
-	case 192000:
-		gpiod_set_value(osr0, true);
-		gpiod_set_value(osr1, true);
-		gpiod_set_value(osr2, true);
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		pisnd_first_capture_stop(pisnd, false);
 		break;
-	default:
-		printe("Unsupported rate %u!\n", params_rate(params));
-		return -EINVAL;
 	}
 
-	gpiod_set_value(reset, true);
-
 	return 0;
 }
 
@@ -916,6 +1817,85 @@ static struct snd_pcm_hw_constraint_list constraints_rates = {
 	.mask = 0,
 };
 
+/* Smallest period sizes, in frames, for 48, 96 and 192kHz, that the
+ * bcm2835 I2S DMA keeps up with reliably, roughly 0.67ms at each rate.
+ */
+static const unsigned int pisnd_min_period_size[3] = { 32, 64, 128 };
+
+enum { PISND_PERIOD_SIZE_STEP = 16 };
+
+static unsigned int pisnd_get_min_period_size(unsigned int rate)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(rates); ++i)
+		if (rate <= rates[i])
+			return pisnd_min_period_size[i];
+
+	return pisnd_min_period_size[ARRAY_SIZE(rates) - 1];
+}
+
+static int pisnd_rule_period_size(
+	struct snd_pcm_hw_params *params,
+	struct snd_pcm_hw_rule *rule
+	)
+{
+	struct snd_interval *rate =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+	struct snd_interval *period_size =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE);
+	struct snd_interval range;
+
+	/* Bound by the lowest rate still possible, so no valid
+	 * configuration gets refined away.
+	 */
+	snd_interval_any(&range);
+	range.min = pisnd_get_min_period_size(rate->min);
+
+	return snd_interval_refine(period_size, &range);
+}
+
+static int pisnd_low_latency_constraints(struct snd_pcm_runtime *runtime)
+{
+	int err = snd_pcm_hw_constraint_integer(
+		runtime,
+		SNDRV_PCM_HW_PARAM_PERIODS
+		);
+
+	if (err < 0)
+		return err;
+
+	err = snd_pcm_hw_constraint_minmax(
+		runtime,
+		SNDRV_PCM_HW_PARAM_PERIODS,
+		2,
+		UINT_MAX
+		);
+
+	if (err < 0)
+		return err;
+
+	err = snd_pcm_hw_constraint_step(
+		runtime,
+		0,
+		SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+		PISND_PERIOD_SIZE_STEP
+		);
+
+	if (err < 0)
+		return err;
+
+	return snd_pcm_hw_rule_add(
+		runtime,
+		0,
+		SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+		pisnd_rule_period_size,
+		NULL,
+		SNDRV_PCM_HW_PARAM_RATE,
+		-1
+		);
+}
+
 static int pisnd_startup(struct snd_pcm_substream *substream)
 {
 	int err = snd_pcm_hw_constraint_list(
@@ -948,35 +1928,108 @@ static int pisnd_startup(struct snd_pcm_substream *substream)
 	if (err < 0)
 		return err;
 
+	if (low_latency) {
+		err = pisnd_low_latency_constraints(substream->runtime);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/* Digital filter group delays of the converters, in frames, for 48, 96
+ * and 192kHz. These are the nominal datasheet figures, PCM1804 for the
+ * ADC and PCM5102A with its default interpolation filter for the DAC,
+ * rounded to whole frames, so treat them as approximate. The analog
+ * paths add a few more microseconds on top.
+ */
+static const unsigned int pisnd_adc_delay[3] = { 37, 37, 10 };
+static const unsigned int pisnd_dac_delay[3] = { 22, 22, 22 };
+
+static snd_pcm_sframes_t pisnd_codec_delay(
+	struct snd_pcm_substream *substream,
+	struct snd_soc_dai *dai
+	)
+{
+	const unsigned int *delay;
+	unsigned int i;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		delay = pisnd_adc_delay;
+	else
+		delay = pisnd_dac_delay;
+
+	for (i = 0; i < ARRAY_SIZE(rates); ++i)
+		if (rates[i] == substream->runtime->rate)
+			return delay[i];
+
 	return 0;
 }
 
+static const struct snd_soc_dai_ops pisnd_codec_dai_ops = {
+	.delay = pisnd_codec_delay,
+};
+
+#define PISND_CODEC_RATES \
+	(SNDRV_PCM_RATE_48000 | SNDRV_PCM_RATE_96000 | SNDRV_PCM_RATE_192000)
+#define PISND_CODEC_FORMATS \
+	(SNDRV_PCM_FMTBIT_S16_LE | \
+	SNDRV_PCM_FMTBIT_S24_LE | \
+	SNDRV_PCM_FMTBIT_S32_LE)
+
+/* The converters are hardwired and clocked by the ADC, so there's nothing
+ * to control, the codec DAI is there to report the converter delays.
+ */
+static struct snd_soc_dai_driver pisnd_codec_dai = {
+	.name = "pisound-codec",
+	.playback = {
+		.stream_name  = "Playback",
+		.channels_min = 2,
+		.channels_max = 2,
+		.rates        = PISND_CODEC_RATES,
+		.formats      = PISND_CODEC_FORMATS,
+	},
+	.capture = {
+		.stream_name  = "Capture",
+		.channels_min = 2,
+		.channels_max = 2,
+		.rates        = PISND_CODEC_RATES,
+		.formats      = PISND_CODEC_FORMATS,
+	},
+	.ops = &pisnd_codec_dai_ops,
+};
+
+static const struct snd_soc_component_driver pisnd_codec_driver = {
+	.name = "pisound-codec",
+};
+
 static struct snd_soc_ops pisnd_ops = {
 	.startup = pisnd_startup,
 	.hw_params = pisnd_hw_params,
+	.hw_free = pisnd_hw_free,
+	.trigger = pisnd_trigger,
 };
 
 SND_SOC_DAILINK_DEFS(pisnd,
 	DAILINK_COMP_ARRAY(COMP_CPU("bcm2708-i2s.0")),
-	DAILINK_COMP_ARRAY(COMP_DUMMY()),
+	DAILINK_COMP_ARRAY(COMP_CODEC(NULL, "pisound-codec")),
 	DAILINK_COMP_ARRAY(COMP_PLATFORM("bcm2708-i2s.0")));
 
-static struct snd_soc_dai_link pisnd_dai[] = {
-	{
-		.name           = "pisound",
-		.stream_name    = "pisound",
-		.dai_fmt        =
-			SND_SOC_DAIFMT_I2S |
-			SND_SOC_DAIFMT_NB_NF |
-			SND_SOC_DAIFMT_CBM_CFM,
-		.ops            = &pisnd_ops,
-		SND_SOC_DAILINK_REG(pisnd),
-	},
+static const struct snd_soc_dai_link pisnd_dai_template = {
+	.name           = "pisound",
+	.stream_name    = "pisound",
+	.dai_fmt        =
+		SND_SOC_DAIFMT_I2S |
+		SND_SOC_DAIFMT_NB_NF |
+		SND_SOC_DAIFMT_CBM_CFM,
+	.ops            = &pisnd_ops,
+	SND_SOC_DAILINK_REG(pisnd),
 };
 
 static int pisnd_card_probe(struct snd_soc_card *card)
 {
-	int err = pisnd_midi_init(card->snd_card);
+	struct pisnd *pisnd = snd_soc_card_get_drvdata(card);
+	int err = pisnd_midi_init(pisnd, card->snd_card);
 
 	if (err < 0) {
 		printe("pisnd_midi_init failed: %d\n", err);
@@ -994,79 +2047,412 @@ static int pisnd_card_probe(struct snd_soc_card *card)
 
 static int pisnd_card_remove(struct snd_soc_card *card)
 {
+	struct pisnd *pisnd = snd_soc_card_get_drvdata(card);
+
 	pisnd_ctl_uninit();
-	pisnd_midi_uninit();
+	pisnd_midi_uninit(pisnd);
 	return 0;
 }
 
-static struct snd_soc_card pisnd_card = {
-	.name         = "pisound",
-	.owner        = THIS_MODULE,
-	.dai_link     = pisnd_dai,
-	.num_links    = ARRAY_SIZE(pisnd_dai),
-	.probe        = pisnd_card_probe,
-	.remove       = pisnd_card_remove,
-};
-
-static int pisnd_init_gpio(struct device *dev)
+static int pisnd_init_card(struct pisnd *pisnd, struct device *dev)
 {
-	osr0 = gpiod_get_index(dev, "osr", 0, GPIOD_ASIS);
-	osr1 = gpiod_get_index(dev, "osr", 1, GPIOD_ASIS);
-	osr2 = gpiod_get_index(dev, "osr", 2, GPIOD_ASIS);
-
-	reset = gpiod_get_index(dev, "reset", 0, GPIOD_ASIS);
+	struct snd_soc_dai_link *dai = &pisnd->dai;
 
-	button = gpiod_get_index(dev, "button", 0, GPIOD_ASIS);
-
-	gpiod_direction_output(osr0,  1);
-	gpiod_direction_output(osr1,  1);
-	gpiod_direction_output(osr2,  1);
-	gpiod_direction_output(reset, 1);
+	/* The dai link and its components get adjusted per device, so each
+	 * instance gets its own copy of the template.
+	 */
+	*dai = pisnd_dai_template;
+
+	dai->cpus = devm_kmemdup(dev, pisnd_cpus, sizeof(pisnd_cpus), GFP_KERNEL);
+	dai->codecs = devm_kmemdup(dev, pisnd_codecs, sizeof(pisnd_codecs), GFP_KERNEL);
+	dai->platforms = devm_kmemdup(
+		dev,
+		pisnd_platforms,
+		sizeof(pisnd_platforms),
+		GFP_KERNEL
+		);
 
-	gpiod_set_value(reset, false);
-	gpiod_set_value(osr0,   true);
-	gpiod_set_value(osr1,  false);
-	gpiod_set_value(osr2,  false);
-	gpiod_set_value(reset,  true);
+	if (!dai->cpus || !dai->codecs || !dai->platforms)
+		return -ENOMEM;
 
-	gpiod_export(button, false);
+	dai->codecs->name = dev_name(dev);
 
-	return 0;
-}
+	pisnd->card.name      = "pisound";
+	pisnd->card.owner     = THIS_MODULE;
+	pisnd->card.dev       = dev;
+	pisnd->card.dai_link  = dai;
+	pisnd->card.num_links = 1;
+	pisnd->card.probe     = pisnd_card_probe;
+	pisnd->card.remove    = pisnd_card_remove;
 
-static int pisnd_uninit_gpio(void)
-{
-	int i;
+	snd_soc_card_set_drvdata(&pisnd->card, pisnd);
 
-	struct gpio_desc **gpios[] = {
-		&osr0, &osr1, &osr2, &reset, &button,
-	};
+	if (dev->of_node) {
+		struct device_node *i2s_node;
 
-	gpiod_unexport(button);
+		i2s_node = of_parse_phandle(
+			dev->of_node,
+			"i2s-controller",
+			0
+			);
 
-	for (i = 0; i < ARRAY_SIZE(gpios); ++i) {
-		if (*gpios[i] == NULL) {
-			printd("weird, GPIO[%d] is NULL already\n", i);
-			continue;
+		if (i2s_node) {
+			dai->cpus->dai_name = NULL;
+			dai->cpus->of_node = i2s_node;
+			dai->platforms->name = NULL;
+			dai->platforms->of_node = i2s_node;
+			dai->stream_name = pisnd_spi_get_serial(pisnd);
 		}
-
-		gpiod_put(*gpios[i]);
-		*gpios[i] = NULL;
 	}
 
 	return 0;
 }
 
-static struct kobject *pisnd_kobj;
+static void pisnd_gesture_work_handler(struct work_struct *work)
+{
+	struct pisnd *pisnd = container_of(work, struct pisnd, gesture_work);
+	struct pisnd_gesture gesture;
+	char type[32], clicks[32], hold_ms[32];
+	char *envp[] = { type, clicks, hold_ms, NULL };
+
+	while (kfifo_out_spinlocked(
+		&pisnd->gesture_fifo,
+		&gesture,
+		1,
+		&pisnd->gesture_lock
+		)) {
+		snprintf(type, sizeof(type), "PISOUND_GESTURE=%s",
+			gesture.type == GESTURE_CLICK ? "click" : "hold");
+		snprintf(clicks, sizeof(clicks), "PISOUND_CLICKS=%u",
+			gesture.clicks);
+		snprintf(hold_ms, sizeof(hold_ms), "PISOUND_HOLD_MS=%u",
+			gesture.hold_ms);
+
+		if (gesture.type == GESTURE_CLICK)
+			envp[2] = NULL;
+		else
+			envp[2] = hold_ms;
+
+		kobject_uevent_env(
+			&pisnd->button_input->dev.kobj,
+			KOBJ_CHANGE,
+			envp
+			);
+	}
+}
 
-static ssize_t pisnd_serial_show(
-	struct kobject *kobj,
-	struct kobj_attribute *attr,
-	char *buf
+/* Expects gesture_lock to be held. */
+static void pisnd_gesture_emit(
+	struct pisnd *pisnd,
+	enum pisnd_gesture_e type,
+	unsigned int clicks,
+	unsigned int hold_ms
 	)
 {
-	return sprintf(buf, "%s\n", pisnd_spi_get_serial());
-}
+	struct pisnd_gesture gesture = {
+		.type    = type,
+		.clicks  = clicks,
+		.hold_ms = hold_ms,
+	};
+
+	if (!kfifo_put(&pisnd->gesture_fifo, gesture))
+		printe("Gesture queue full, dropping gesture!\n");
+
+	schedule_work(&pisnd->gesture_work);
+}
+
+static enum hrtimer_restart pisnd_gesture_timer_handler(struct hrtimer *timer)
+{
+	struct pisnd *pisnd = container_of(timer, struct pisnd, gesture_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&pisnd->gesture_lock, flags);
+
+	if (!pisnd->gesture_down)
+		pisnd_gesture_emit(
+			pisnd,
+			GESTURE_CLICK,
+			pisnd->gesture_clicks,
+			0
+			);
+	pisnd->gesture_timer_running = false;
+
+	spin_unlock_irqrestore(&pisnd->gesture_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/* The click window is timed from the interrupt timestamp of the press,
+ * so how late the handlers run doesn't affect the decoding. Like in
+ * pisound-btn, a press outlasting the window is a hold, so a single
+ * window serves both.
+ */
+static void pisnd_gesture_update(struct pisnd *pisnd, bool pressed, ktime_t at)
+{
+	unsigned long flags;
+	unsigned int held_ms;
+
+	spin_lock_irqsave(&pisnd->gesture_lock, flags);
+
+	if (pressed) {
+		pisnd->gesture_down = true;
+
+		if (!pisnd->gesture_timer_running) {
+			pisnd->gesture_clicks = 1;
+			pisnd->gesture_timer_running = true;
+		} else if (pisnd->click_count_limit == 0 ||
+			pisnd->gesture_clicks < pisnd->click_count_limit) {
+			++pisnd->gesture_clicks;
+		}
+
+		pisnd->gesture_pressed_at = at;
+
+		hrtimer_start(
+			&pisnd->gesture_timer,
+			ktime_add_ms(at, pisnd->click_window_ms),
+			HRTIMER_MODE_ABS
+			);
+	} else if (pisnd->gesture_down) {
+		pisnd->gesture_down = false;
+
+		held_ms = ktime_ms_delta(at, pisnd->gesture_pressed_at);
+		if (held_ms >= pisnd->click_window_ms)
+			pisnd_gesture_emit(
+				pisnd,
+				GESTURE_HOLD,
+				pisnd->gesture_clicks,
+				held_ms
+				);
+	}
+
+	spin_unlock_irqrestore(&pisnd->gesture_lock, flags);
+}
+
+static void pisnd_button_report(struct pisnd *pisnd, bool pressed, ktime_t at)
+{
+	if (pressed == pisnd->button_pressed)
+		return;
+
+	pisnd->button_pressed = pressed;
+
+	input_set_timestamp(pisnd->button_input, at);
+	input_report_key(pisnd->button_input, KEY_PROG1, pressed);
+	input_sync(pisnd->button_input);
+
+	if (button_gestures)
+		pisnd_gesture_update(pisnd, pressed, at);
+}
+
+static enum hrtimer_restart pisnd_button_timer_handler(struct hrtimer *timer)
+{
+	struct pisnd *pisnd = container_of(timer, struct pisnd, button_timer);
+
+	pisnd_button_report(
+		pisnd,
+		gpiod_get_value(pisnd->button),
+		pisnd->button_edge_at
+		);
+
+	return HRTIMER_NORESTART;
+}
+
+static irqreturn_t pisnd_button_interrupt_handler(int irq, void *dev_id)
+{
+	struct pisnd *pisnd = dev_id;
+	ktime_t now = ktime_get();
+
+	if (pisnd->button_debounce_ns == 0) {
+		pisnd_button_report(pisnd, gpiod_get_value(pisnd->button), now);
+		return IRQ_HANDLED;
+	}
+
+	/* The event is stamped with the first edge of a bounce burst, and
+	 * reported once the line has been stable for the debounce time.
+	 */
+	if (!hrtimer_is_queued(&pisnd->button_timer))
+		pisnd->button_edge_at = now;
+
+	hrtimer_start(
+		&pisnd->button_timer,
+		ns_to_ktime(pisnd->button_debounce_ns),
+		HRTIMER_MODE_REL
+		);
+
+	return IRQ_HANDLED;
+}
+
+static int pisnd_init_button(struct pisnd *pisnd, struct device *dev)
+{
+	struct input_dev *input;
+	int err;
+
+	if (IS_ERR_OR_NULL(pisnd->button))
+		return -ENODEV;
+
+	/* The line gets read from the hard interrupt and the timer. */
+	if (gpiod_cansleep(pisnd->button))
+		return -EINVAL;
+
+	pisnd->button_irq = gpiod_to_irq(pisnd->button);
+	if (pisnd->button_irq < 0)
+		return pisnd->button_irq;
+
+	/* Prefer the GPIO controller's debouncing, if it has any. */
+	pisnd->button_debounce_ns = 0;
+	if (button_debounce_ms != 0 && gpiod_set_debounce(
+		pisnd->button,
+		button_debounce_ms * USEC_PER_MSEC
+		) != 0)
+		pisnd->button_debounce_ns = button_debounce_ms * NSEC_PER_MSEC;
+
+	hrtimer_init(&pisnd->button_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pisnd->button_timer.function = pisnd_button_timer_handler;
+
+	spin_lock_init(&pisnd->gesture_lock);
+	hrtimer_init(&pisnd->gesture_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	pisnd->gesture_timer.function = pisnd_gesture_timer_handler;
+	INIT_WORK(&pisnd->gesture_work, pisnd_gesture_work_handler);
+	INIT_KFIFO(pisnd->gesture_fifo);
+	pisnd->gesture_timer_running = false;
+	pisnd->gesture_down = false;
+
+	input = input_allocate_device();
+	if (!input)
+		return -ENOMEM;
+
+	input->name = "pisound button";
+	input->phys = "pisound/input0";
+	input->id.bustype = BUS_HOST;
+	input->dev.parent = dev;
+	input_set_capability(input, EV_KEY, KEY_PROG1);
+
+	pisnd->button_input = input;
+	pisnd->button_pressed = gpiod_get_value(pisnd->button);
+
+	err = input_register_device(input);
+	if (err < 0) {
+		input_free_device(input);
+		pisnd->button_input = NULL;
+		return err;
+	}
+
+	/* Shared with the legacy sysfs GPIO edge interrupt that
+	 * pisound-btn may still request on the exported pin.
+	 */
+	err = request_irq(
+		pisnd->button_irq,
+		pisnd_button_interrupt_handler,
+		IRQF_SHARED | IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+		"pisound_button",
+		pisnd
+		);
+	if (err < 0) {
+		input_unregister_device(input);
+		pisnd->button_input = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+static void pisnd_uninit_button(struct pisnd *pisnd)
+{
+	if (!pisnd->button_input)
+		return;
+
+	free_irq(pisnd->button_irq, pisnd);
+	hrtimer_cancel(&pisnd->button_timer);
+	hrtimer_cancel(&pisnd->gesture_timer);
+	cancel_work_sync(&pisnd->gesture_work);
+
+	input_unregister_device(pisnd->button_input);
+	pisnd->button_input = NULL;
+}
+
+static int pisnd_init_gpio(struct pisnd *pisnd, struct device *dev)
+{
+	int err;
+
+	pisnd->osr = gpiod_get_array(dev, "osr", GPIOD_OUT_HIGH);
+	if (IS_ERR(pisnd->osr)) {
+		err = PTR_ERR(pisnd->osr);
+		printe("Failed to get OSR GPIOs: %d\n", err);
+		pisnd->osr = NULL;
+		return err;
+	}
+
+	pisnd->reset = gpiod_get_index(dev, "reset", 0, GPIOD_ASIS);
+
+	pisnd->button = gpiod_get_index(dev, "button", 0, GPIOD_ASIS);
+
+	gpiod_direction_output(pisnd->reset, 1);
+
+	pisnd->rate = 0;
+	pisnd_set_rate(pisnd, 48000);
+
+	/* Only the resets done for the streams are counted. */
+	pisnd->adc_resets = 0;
+
+	hrtimer_init(
+		&pisnd->first_capture_timer,
+		CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL
+		);
+	pisnd->first_capture_timer.function = pisnd_first_capture_timer;
+
+	gpiod_export(pisnd->button, false);
+
+	/* Not fatal, the button is still available via the exported GPIO. */
+	err = pisnd_init_button(pisnd, dev);
+	if (err < 0)
+		printe("Button input device init failed: %d\n", err);
+
+	return 0;
+}
+
+static int pisnd_uninit_gpio(struct pisnd *pisnd)
+{
+	int i;
+
+	struct gpio_desc **gpios[] = {
+		&pisnd->reset, &pisnd->button,
+	};
+
+	pisnd_uninit_button(pisnd);
+	gpiod_unexport(pisnd->button);
+
+	if (pisnd->osr) {
+		gpiod_put_array(pisnd->osr);
+		pisnd->osr = NULL;
+	}
+	pisnd->rate = 0;
+
+	for (i = 0; i < ARRAY_SIZE(gpios); ++i) {
+		if (*gpios[i] == NULL) {
+			printd("weird, GPIO[%d] is NULL already\n", i);
+			continue;
+		}
+
+		gpiod_put(*gpios[i]);
+		*gpios[i] = NULL;
+	}
+
+	return 0;
+}
+
+static inline struct pisnd *pisnd_from_kobj(struct kobject *kobj)
+{
+	return container_of(kobj, struct pisnd, kobj);
+}
+
+static ssize_t pisnd_serial_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%s\n", pisnd_spi_get_serial(pisnd_from_kobj(kobj)));
+}
 
 static ssize_t pisnd_id_show(
 	struct kobject *kobj,
@@ -1074,7 +2460,7 @@ static ssize_t pisnd_id_show(
 	char *buf
 	)
 {
-	return sprintf(buf, "%s\n", pisnd_spi_get_id());
+	return sprintf(buf, "%s\n", pisnd_spi_get_id(pisnd_from_kobj(kobj)));
 }
 
 static ssize_t pisnd_fw_version_show(
@@ -1083,7 +2469,8 @@ static ssize_t pisnd_fw_version_show(
 	char *buf
 	)
 {
-	return sprintf(buf, "%s\n", pisnd_spi_get_fw_version());
+	return sprintf(buf, "%s\n",
+		pisnd_spi_get_fw_version(pisnd_from_kobj(kobj)));
 }
 
 static ssize_t pisnd_hw_version_show(
@@ -1092,7 +2479,8 @@ static ssize_t pisnd_hw_version_show(
 	char *buf
 )
 {
-	return sprintf(buf, "%s\n", pisnd_spi_get_hw_version());
+	return sprintf(buf, "%s\n",
+		pisnd_spi_get_hw_version(pisnd_from_kobj(kobj)));
 }
 
 static ssize_t pisnd_led_store(
@@ -1108,11 +2496,203 @@ static ssize_t pisnd_led_store(
 	err = kstrtou32(buf, 10, &timeout);
 
 	if (err == 0 && timeout <= 255)
-		pisnd_spi_flash_leds(timeout);
+		pisnd_spi_flash_leds(pisnd_from_kobj(kobj), timeout);
+
+	return length;
+}
+
+static ssize_t pisnd_midi_in_dropped_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%lu\n",
+		READ_ONCE(pisnd_from_kobj(kobj)->in_dropped));
+}
+
+static ssize_t pisnd_midi_out_flow_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	struct pisnd *pisnd = pisnd_from_kobj(kobj);
+
+	if (!READ_ONCE(pisnd->credits_enabled))
+		return sprintf(buf, "estimate\n");
+
+	if (!READ_ONCE(pisnd->credits_confirmed))
+		return sprintf(buf, "credits pending\n");
+
+	return sprintf(buf, "credits %d reports %lu\n",
+		READ_ONCE(pisnd->out_credits),
+		READ_ONCE(pisnd->credit_frames));
+}
+
+static ssize_t pisnd_midi_in_throttled_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%lu\n",
+		READ_ONCE(pisnd_from_kobj(kobj)->in_throttle_count));
+}
+
+static ssize_t pisnd_adc_resets_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%lu\n",
+		READ_ONCE(pisnd_from_kobj(kobj)->adc_resets));
+}
+
+static ssize_t pisnd_adc_reset_skips_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%lu\n",
+		READ_ONCE(pisnd_from_kobj(kobj)->adc_reset_skips));
+}
+
+static ssize_t pisnd_first_capture_us_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%lld\n",
+		READ_ONCE(pisnd_from_kobj(kobj)->first_capture_us));
+}
+
+static ssize_t pisnd_min_period_size_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(rates); ++i)
+		n += sprintf(buf + n, "%s%u:%u", i ? " " : "", rates[i],
+			pisnd_min_period_size[i]);
+
+	n += sprintf(buf + n, "\n");
+	return n;
+}
+
+static ssize_t pisnd_click_window_ms_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%u\n",
+		READ_ONCE(pisnd_from_kobj(kobj)->click_window_ms));
+}
+
+static ssize_t pisnd_click_window_ms_store(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf,
+	size_t length
+	)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err < 0)
+		return err;
+
+	if (value == 0)
+		return -EINVAL;
+
+	WRITE_ONCE(pisnd_from_kobj(kobj)->click_window_ms, value);
 
 	return length;
 }
 
+static ssize_t pisnd_click_count_limit_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%u\n",
+		READ_ONCE(pisnd_from_kobj(kobj)->click_count_limit));
+}
+
+/* 0 means no limit. */
+static ssize_t pisnd_click_count_limit_store(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf,
+	size_t length
+	)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err < 0)
+		return err;
+
+	WRITE_ONCE(pisnd_from_kobj(kobj)->click_count_limit, value);
+
+	return length;
+}
+
+static ssize_t pisnd_cpus_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	return sprintf(buf, "%*pbl\n",
+		cpumask_pr_args(&pisnd_from_kobj(kobj)->cpus));
+}
+
+static ssize_t pisnd_cpus_store(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	const char *buf,
+	size_t length
+	)
+{
+	cpumask_var_t mask;
+	int err;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	err = cpulist_parse(buf, mask);
+	if (err == 0)
+		err = pisnd_set_cpus(pisnd_from_kobj(kobj), mask);
+
+	free_cpumask_var(mask);
+
+	return err < 0 ? err : length;
+}
+
+static ssize_t pisnd_last_cpus_show(
+	struct kobject *kobj,
+	struct kobj_attribute *attr,
+	char *buf
+	)
+{
+	struct pisnd *pisnd = pisnd_from_kobj(kobj);
+
+	return sprintf(buf, "irq %d work %d\n",
+		READ_ONCE(pisnd->last_irq_cpu),
+		READ_ONCE(pisnd->last_work_cpu));
+}
+
 static struct kobj_attribute pisnd_serial_attribute =
 	__ATTR(serial, 0444, pisnd_serial_show, NULL);
 static struct kobj_attribute pisnd_id_attribute =
@@ -1123,6 +2703,31 @@ static struct kobj_attribute pisnd_hw_version_attribute =
 __ATTR(hw_version, 0444, pisnd_hw_version_show, NULL);
 static struct kobj_attribute pisnd_led_attribute =
 	__ATTR(led, 0644, NULL, pisnd_led_store);
+static struct kobj_attribute pisnd_midi_in_dropped_attribute =
+	__ATTR(midi_in_dropped, 0444, pisnd_midi_in_dropped_show, NULL);
+static struct kobj_attribute pisnd_midi_out_flow_attribute =
+	__ATTR(midi_out_flow, 0444, pisnd_midi_out_flow_show, NULL);
+static struct kobj_attribute pisnd_midi_in_throttled_attribute =
+	__ATTR(midi_in_throttled, 0444, pisnd_midi_in_throttled_show, NULL);
+static struct kobj_attribute pisnd_adc_resets_attribute =
+	__ATTR(adc_resets, 0444, pisnd_adc_resets_show, NULL);
+static struct kobj_attribute pisnd_adc_reset_skips_attribute =
+	__ATTR(adc_reset_skips, 0444, pisnd_adc_reset_skips_show, NULL);
+static struct kobj_attribute pisnd_first_capture_us_attribute =
+	__ATTR(first_capture_us, 0444, pisnd_first_capture_us_show, NULL);
+static struct kobj_attribute pisnd_min_period_size_attribute =
+	__ATTR(min_period_size, 0444, pisnd_min_period_size_show, NULL);
+static struct kobj_attribute pisnd_cpus_attribute =
+	__ATTR(cpus, 0644, pisnd_cpus_show, pisnd_cpus_store);
+static struct kobj_attribute pisnd_last_cpus_attribute =
+	__ATTR(last_cpus, 0444, pisnd_last_cpus_show, NULL);
+static struct kobj_attribute pisnd_click_window_ms_attribute =
+	__ATTR(click_window_ms, 0644,
+		pisnd_click_window_ms_show, pisnd_click_window_ms_store);
+static struct kobj_attribute pisnd_click_count_limit_attribute =
+	__ATTR(click_count_limit, 0644,
+		pisnd_click_count_limit_show, pisnd_click_count_limit_store);
+
 
 static struct attribute *attrs[] = {
 	&pisnd_serial_attribute.attr,
@@ -1130,74 +2735,514 @@ static struct attribute *attrs[] = {
 	&pisnd_fw_version_attribute.attr,
 	&pisnd_hw_version_attribute.attr,
 	&pisnd_led_attribute.attr,
+	&pisnd_midi_in_dropped_attribute.attr,
+	&pisnd_midi_in_throttled_attribute.attr,
+	&pisnd_midi_out_flow_attribute.attr,
+	&pisnd_adc_resets_attribute.attr,
+	&pisnd_adc_reset_skips_attribute.attr,
+	&pisnd_first_capture_us_attribute.attr,
+	&pisnd_min_period_size_attribute.attr,
+	&pisnd_cpus_attribute.attr,
+	&pisnd_last_cpus_attribute.attr,
+	&pisnd_click_window_ms_attribute.attr,
+	&pisnd_click_count_limit_attribute.attr,
 	NULL
 };
 
 static struct attribute_group attr_group = { .attrs = attrs };
 
-static int pisnd_probe(struct platform_device *pdev)
+static void pisnd_release(struct kobject *kobj)
+{
+	struct pisnd *pisnd = pisnd_from_kobj(kobj);
+
+	ida_free(&pisnd_ida, pisnd->index);
+	kfree(pisnd);
+}
+
+static struct kobj_type pisnd_ktype = {
+	.release   = pisnd_release,
+	.sysfs_ops = &kobj_sysfs_ops,
+};
+
+static enum hrtimer_restart pisnd_led_timer_handler(struct hrtimer *timer)
+{
+	struct pisnd *pisnd = container_of(timer, struct pisnd, led_timer);
+	struct pisnd_led_step *step;
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pisnd->led_lock, flags);
+
+	if (pisnd->led_step_count == 0)
+		goto out;
+
+	step = &pisnd->led_steps[pisnd->led_step];
+	if (step->flash != 0)
+		pisnd_spi_flash_leds(pisnd, step->flash);
+
+	hrtimer_forward_now(timer, ms_to_ktime(step->period_ms));
+
+	/* A repeat count of -1 goes on until the pattern is cleared. */
+	if (++pisnd->led_step == pisnd->led_step_count) {
+		pisnd->led_step = 0;
+		if (pisnd->led_repeat > 0 && --pisnd->led_repeat == 0)
+			pisnd->led_step_count = 0;
+	}
+
+	if (pisnd->led_step_count != 0)
+		restart = HRTIMER_RESTART;
+
+out:
+	spin_unlock_irqrestore(&pisnd->led_lock, flags);
+	return restart;
+}
+
+static inline struct pisnd *pisnd_from_led(struct led_classdev *led)
+{
+	return container_of(led, struct pisnd, led);
+}
+
+/* The LEDs can only be flashed, so turning them on gives a short flash,
+ * for triggers such as timer or heartbeat.
+ */
+static void pisnd_led_brightness_set(
+	struct led_classdev *led,
+	enum led_brightness value
+	)
 {
+	if (value != LED_OFF)
+		pisnd_spi_flash_leds(pisnd_from_led(led), LED_DEFAULT_FLASH);
+}
+
+/* Set through the pattern trigger's hw_pattern attribute, which takes
+ * '<flash duration> <period ms>' pairs. Each step flashes the LEDs for
+ * the duration, [0;255], 0 just pauses, then waits for the period before
+ * the next one.
+ */
+static int pisnd_led_pattern_set(
+	struct led_classdev *led,
+	struct led_pattern *pattern,
+	u32 len,
+	int repeat
+	)
+{
+	struct pisnd *pisnd = pisnd_from_led(led);
+	unsigned long flags;
+	u32 i;
+
+	if (len == 0 || len > LED_PATTERN_MAX_STEPS)
+		return -EINVAL;
+
+	for (i = 0; i < len; ++i)
+		if (pattern[i].brightness < 0 ||
+			pattern[i].brightness > 255 ||
+			pattern[i].delta_t < LED_PATTERN_MIN_PERIOD_MS)
+			return -EINVAL;
+
+	spin_lock_irqsave(&pisnd->led_lock, flags);
+
+	for (i = 0; i < len; ++i) {
+		pisnd->led_steps[i].flash = pattern[i].brightness;
+		pisnd->led_steps[i].period_ms = pattern[i].delta_t;
+	}
+	pisnd->led_step_count = len;
+	pisnd->led_step = 0;
+	pisnd->led_repeat = repeat;
+
+	hrtimer_start(&pisnd->led_timer, 0, HRTIMER_MODE_REL);
+
+	spin_unlock_irqrestore(&pisnd->led_lock, flags);
+	return 0;
+}
+
+/* The timer stops by itself, once it finds no steps. */
+static int pisnd_led_pattern_clear(struct led_classdev *led)
+{
+	struct pisnd *pisnd = pisnd_from_led(led);
+	unsigned long flags;
+
+	spin_lock_irqsave(&pisnd->led_lock, flags);
+	pisnd->led_step_count = 0;
+	spin_unlock_irqrestore(&pisnd->led_lock, flags);
+
+	return 0;
+}
+
+static int pisnd_init_led(struct pisnd *pisnd, struct device *dev)
+{
+	int ret;
+
+	spin_lock_init(&pisnd->led_lock);
+	hrtimer_init(&pisnd->led_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pisnd->led_timer.function = pisnd_led_timer_handler;
+	pisnd->led_step_count = 0;
+	pisnd->led_step = 0;
+
+	if (pisnd->index == 0)
+		strscpy(pisnd->led_name, "pisound::flash",
+			sizeof(pisnd->led_name));
+	else
+		snprintf(pisnd->led_name, sizeof(pisnd->led_name),
+			"pisound-%d::flash", pisnd->index);
+
+	pisnd->led.name = pisnd->led_name;
+	pisnd->led.max_brightness = 1;
+	pisnd->led.brightness_set = pisnd_led_brightness_set;
+	pisnd->led.pattern_set = pisnd_led_pattern_set;
+	pisnd->led.pattern_clear = pisnd_led_pattern_clear;
+
+	ret = led_classdev_register(dev, &pisnd->led);
+	pisnd->led_registered = ret == 0;
+
+	return ret;
+}
+
+static void pisnd_uninit_led(struct pisnd *pisnd)
+{
+	if (!pisnd->led_registered)
+		return;
+
+	led_classdev_unregister(&pisnd->led);
+	pisnd->led_registered = false;
+
+	pisnd_led_pattern_clear(&pisnd->led);
+	hrtimer_cancel(&pisnd->led_timer);
+}
+
+/* Each line is '<ns> <transfer> <tx frame> <rx frame>', oldest first.
+ * The ring is snapshotted on open, so the capture keeps running while
+ * it's being read.
+ */
+static int pisnd_capture_show(struct seq_file *m, void *v)
+{
+	const struct pisnd_capture_frame *frame;
+	const struct pisnd_capture_frame *frames = m->private;
+	unsigned int i;
+
+	seq_puts(m, "# pisound spi capture v1\n");
+
+	/* The snapshot ends with a zeroed frame, transfers count from 1. */
+	for (i = 0; frames[i].transfer != 0; ++i) {
+		frame = &frames[i];
+		seq_printf(m, "%llu %u %02x%02x %02x%02x\n",
+			frame->ns,
+			frame->transfer,
+			frame->tx[0], frame->tx[1],
+			frame->rx[0], frame->rx[1]);
+	}
+
+	return 0;
+}
+
+static int pisnd_capture_open(struct inode *inode, struct file *file)
+{
+	struct pisnd *pisnd = inode->i_private;
+	struct pisnd_capture_frame *frames;
+	unsigned long flags;
+	unsigned int i, n;
+	int ret;
+
+	n = pisnd->capture_size;
+	frames = kvcalloc(n + 1, sizeof(*frames), GFP_KERNEL);
+	if (!frames)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&pisnd->capture_lock, flags);
+	for (i = 0; i < pisnd->capture_count; ++i)
+		frames[i] = pisnd->capture[(pisnd->capture_head + i) %
+			pisnd->capture_size];
+	spin_unlock_irqrestore(&pisnd->capture_lock, flags);
+
+	ret = single_open_size(file, pisnd_capture_show, frames,
+		(n + 1) * 48);
+	if (ret < 0)
+		kvfree(frames);
+
+	return ret;
+}
+
+static int pisnd_capture_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	kvfree(m->private);
+	return single_release(inode, file);
+}
+
+/* Any write clears the capture. */
+static ssize_t pisnd_capture_write(
+	struct file *file,
+	const char __user *buf,
+	size_t length,
+	loff_t *ppos
+	)
+{
+	struct pisnd *pisnd = file_inode(file)->i_private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pisnd->capture_lock, flags);
+	pisnd->capture_head = 0;
+	pisnd->capture_count = 0;
+	spin_unlock_irqrestore(&pisnd->capture_lock, flags);
+
+	return length;
+}
+
+static const struct file_operations pisnd_capture_fops = {
+	.owner   = THIS_MODULE,
+	.open    = pisnd_capture_open,
+	.read    = seq_read,
+	.write   = pisnd_capture_write,
+	.llseek  = seq_lseek,
+	.release = pisnd_capture_release,
+};
+
+static void pisnd_sysex_show_dir(
+	struct seq_file *m,
+	const char *dir,
+	const struct pisnd_sysex_stats *stats
+	)
+{
+	bool active = READ_ONCE(stats->active);
+	ktime_t until = active ? ktime_get() : stats->ended_at;
+	s64 us = ktime_us_delta(until, stats->started_at);
+	u64 bytes = stats->bytes;
+
+	seq_printf(m, "%s active %d bytes %llu rate %llu total %llu messages %u\n",
+		dir,
+		active,
+		bytes,
+		us > 0 ? div64_u64(bytes * USEC_PER_SEC, us) : 0,
+		stats->total_bytes,
+		stats->messages);
+}
+
+/* Progress of the current, or otherwise the last, SysEx message in each
+ * direction, the rate is in bytes per second.
+ */
+static int pisnd_sysex_show(struct seq_file *m, void *v)
+{
+	struct pisnd *pisnd = m->private;
+
+	pisnd_sysex_show_dir(m, "out", &pisnd->sysex_out);
+	pisnd_sysex_show_dir(m, "in", &pisnd->sysex_in);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pisnd_sysex);
+
+static void pisnd_init_debugfs(struct pisnd *pisnd)
+{
+	pisnd->debugfs = debugfs_create_dir(kobject_name(&pisnd->kobj), NULL);
+
+	if (pisnd->capture)
+		debugfs_create_file(
+			"capture",
+			0600,
+			pisnd->debugfs,
+			pisnd,
+			&pisnd_capture_fops
+			);
+
+	debugfs_create_file(
+		"sysex",
+		0444,
+		pisnd->debugfs,
+		pisnd,
+		&pisnd_sysex_fops
+		);
+}
+
+static void pisnd_uninit_debugfs(struct pisnd *pisnd)
+{
+	debugfs_remove_recursive(pisnd->debugfs);
+	pisnd->debugfs = NULL;
+}
+
+static int pisnd_bind(struct device *dev)
+{
+	struct pisnd *pisnd = dev_get_drvdata(dev);
 	int ret = 0;
-	int i;
 
-	ret = pisnd_spi_init(&pdev->dev);
+	/* Provides pisnd->spi. */
+	ret = component_bind_all(dev, pisnd);
+	if (ret < 0)
+		return ret;
+
+	ret = pisnd_spi_init(pisnd, dev);
 	if (ret < 0) {
 		printe("pisnd_spi_init failed: %d\n", ret);
+		component_unbind_all(dev, pisnd);
 		return ret;
 	}
 
 	printi("Detected Pisound card:\n");
-	printi("\tSerial:           %s\n", pisnd_spi_get_serial());
-	printi("\tFirmware Version: %s\n", pisnd_spi_get_fw_version());
-	printi("\tHardware Version: %s\n", pisnd_spi_get_hw_version());
-	printi("\tId:               %s\n", pisnd_spi_get_id());
-
-	pisnd_kobj = kobject_create_and_add("pisound", kernel_kobj);
-	if (!pisnd_kobj) {
-		pisnd_spi_uninit();
-		return -ENOMEM;
+	printi("\tSerial:           %s\n", pisnd_spi_get_serial(pisnd));
+	printi("\tFirmware Version: %s\n", pisnd_spi_get_fw_version(pisnd));
+	printi("\tHardware Version: %s\n", pisnd_spi_get_hw_version(pisnd));
+	printi("\tId:               %s\n", pisnd_spi_get_id(pisnd));
+
+	/* The first instance keeps the well known /sys/kernel/pisound path. */
+	if (pisnd->index == 0)
+		ret = kobject_add(&pisnd->kobj, kernel_kobj, "pisound");
+	else
+		ret = kobject_add(
+			&pisnd->kobj,
+			kernel_kobj,
+			"pisound-%d",
+			pisnd->index
+			);
+
+	if (ret < 0) {
+		pisnd_spi_uninit(pisnd);
+		component_unbind_all(dev, pisnd);
+		return ret;
 	}
 
-	ret = sysfs_create_group(pisnd_kobj, &attr_group);
+	ret = sysfs_create_group(&pisnd->kobj, &attr_group);
 	if (ret < 0) {
-		pisnd_spi_uninit();
-		kobject_put(pisnd_kobj);
+		kobject_del(&pisnd->kobj);
+		pisnd_spi_uninit(pisnd);
+		component_unbind_all(dev, pisnd);
 		return -ENOMEM;
 	}
 
-	pisnd_init_gpio(&pdev->dev);
-	pisnd_card.dev = &pdev->dev;
+	ret = pisnd_init_gpio(pisnd, dev);
+	if (ret == 0)
+		ret = devm_snd_soc_register_component(
+			dev,
+			&pisnd_codec_driver,
+			&pisnd_codec_dai,
+			1
+			);
+	if (ret == 0) {
+		ret = pisnd_init_card(pisnd, dev);
+		if (ret == 0)
+			ret = snd_soc_register_card(&pisnd->card);
+	}
 
-	if (pdev->dev.of_node) {
-		struct device_node *i2s_node;
+	if (ret < 0) {
+		if (ret != -EPROBE_DEFER)
+			printe("snd_soc_register_card() failed: %d\n", ret);
+		pisnd_uninit_gpio(pisnd);
+		sysfs_remove_group(&pisnd->kobj, &attr_group);
+		kobject_del(&pisnd->kobj);
+		pisnd_spi_uninit(pisnd);
+		component_unbind_all(dev, pisnd);
+		return ret;
+	}
 
-		i2s_node = of_parse_phandle(
-			pdev->dev.of_node,
-			"i2s-controller",
-			0
-			);
+	/* Not fatal, the legacy led attribute keeps working without it. */
+	ret = pisnd_init_led(pisnd, dev);
+	if (ret < 0)
+		printe("LED class device registration failed: %d\n", ret);
 
-		for (i = 0; i < pisnd_card.num_links; ++i) {
-			struct snd_soc_dai_link *dai = &pisnd_dai[i];
+	pisnd_init_debugfs(pisnd);
 
-			if (i2s_node) {
-				dai->cpus->dai_name = NULL;
-				dai->cpus->of_node = i2s_node;
-				dai->platforms->name = NULL;
-				dai->platforms->of_node = i2s_node;
-				dai->stream_name = pisnd_spi_get_serial();
-			}
-		}
+	return 0;
+}
+
+static void pisnd_unbind(struct device *dev)
+{
+	struct pisnd *pisnd = dev_get_drvdata(dev);
+
+	printi("Unloading.\n");
+
+	sysfs_remove_group(&pisnd->kobj, &attr_group);
+	kobject_del(&pisnd->kobj);
+
+	pisnd_uninit_debugfs(pisnd);
+	pisnd_uninit_led(pisnd);
+
+	/* The card goes first, so MIDI can't schedule any more SPI work. */
+	snd_soc_unregister_card(&pisnd->card);
+
+	pisnd_spi_uninit(pisnd);
+
+	/* Turn off */
+	gpiod_set_value(pisnd->reset, false);
+	pisnd_uninit_gpio(pisnd);
+
+	component_unbind_all(dev, pisnd);
+}
+
+static const struct component_master_ops pisnd_master_ops = {
+	.bind   = pisnd_bind,
+	.unbind = pisnd_unbind,
+};
+
+/* Matches the Pisound SPI device, either the one referenced by the
+ * 'spi-device' phandle, or any, if the property isn't there.
+ */
+static int pisnd_compare_spi(struct device *dev, void *data)
+{
+	struct device_node *np = data;
+
+	if (np)
+		return dev->of_node == np;
+
+	return dev->bus == &spi_bus_type &&
+		strcmp(to_spi_device(dev)->modalias, "pisound-spi") == 0;
+}
+
+static void pisnd_release_spi_node(struct device *dev, void *data)
+{
+	of_node_put(data);
+}
+
+static int pisnd_probe(struct platform_device *pdev)
+{
+	struct component_match *match = NULL;
+	struct device_node *spi_node = NULL;
+	struct pisnd *pisnd;
+	int ret = 0;
+
+	pisnd = kzalloc(sizeof(*pisnd), GFP_KERNEL);
+	if (!pisnd)
+		return -ENOMEM;
+
+	pisnd->index = ida_alloc(&pisnd_ida, GFP_KERNEL);
+	if (pisnd->index < 0) {
+		ret = pisnd->index;
+		kfree(pisnd);
+		return ret;
 	}
 
-	ret = snd_soc_register_card(&pisnd_card);
+	/* From here on, the instance is freed by dropping the kobject. */
+	kobject_init(&pisnd->kobj, &pisnd_ktype);
+
+	/* Same defaults as pisound-btn. */
+	pisnd->click_window_ms = 400;
+	pisnd->click_count_limit = 8;
+
+	platform_set_drvdata(pdev, pisnd);
+
+	if (pdev->dev.of_node)
+		spi_node = of_parse_phandle(pdev->dev.of_node, "spi-device", 0);
+
+	component_match_add_release(
+		&pdev->dev,
+		&match,
+		pisnd_release_spi_node,
+		pisnd_compare_spi,
+		spi_node
+		);
+
+	/* The card gets brought up in pisnd_bind, as soon as the SPI device
+	 * has been bound by pisnd_spi_driver, so there's no need to poll
+	 * for it via probe deferral.
+	 */
+	ret = component_master_add_with_match(
+		&pdev->dev,
+		&pisnd_master_ops,
+		match
+		);
 
 	if (ret < 0) {
 		if (ret != -EPROBE_DEFER)
-			printe("snd_soc_register_card() failed: %d\n", ret);
-		pisnd_uninit_gpio();
-		kobject_put(pisnd_kobj);
-		pisnd_spi_uninit();
+			printe("component_master_add_with_match() failed: %d\n",
+				ret);
+		kobject_put(&pisnd->kobj);
 	}
 
 	return ret;
@@ -1205,23 +3250,87 @@ static int pisnd_probe(struct platform_device *pdev)
 
 static int pisnd_remove(struct platform_device *pdev)
 {
-	printi("Unloading.\n");
+	struct pisnd *pisnd = platform_get_drvdata(pdev);
 
-	if (pisnd_kobj) {
-		kobject_put(pisnd_kobj);
-		pisnd_kobj = NULL;
-	}
+	component_master_del(&pdev->dev, &pisnd_master_ops);
 
-	pisnd_spi_uninit();
+	kobject_put(&pisnd->kobj);
+	return 0;
+}
 
-	/* Turn off */
-	gpiod_set_value(reset, false);
-	pisnd_uninit_gpio();
+static int pisnd_spi_component_bind(
+	struct device *dev,
+	struct device *master,
+	void *data
+	)
+{
+	struct pisnd *pisnd = data;
+	struct spi_device *spi = to_spi_device(dev);
+	int ret;
+
+	ret = spi_setup(spi);
+	if (ret < 0) {
+		printe("spi_setup failed: %d\n", ret);
+		return ret;
+	}
+
+	pisnd->spi = spi_dev_get(spi);
 
-	snd_soc_unregister_card(&pisnd_card);
 	return 0;
 }
 
+static void pisnd_spi_component_unbind(
+	struct device *dev,
+	struct device *master,
+	void *data
+	)
+{
+	struct pisnd *pisnd = data;
+
+	spi_dev_put(pisnd->spi);
+	pisnd->spi = NULL;
+}
+
+static const struct component_ops pisnd_spi_component_ops = {
+	.bind   = pisnd_spi_component_bind,
+	.unbind = pisnd_spi_component_unbind,
+};
+
+static int pisnd_spi_probe(struct spi_device *spi)
+{
+	return component_add(&spi->dev, &pisnd_spi_component_ops);
+}
+
+static void pisnd_spi_remove(struct spi_device *spi)
+{
+	component_del(&spi->dev, &pisnd_spi_component_ops);
+}
+
+static const struct of_device_id pisound_spi_of_match[] = {
+	{ .compatible = "blokaslabs,pisound-spi", },
+	{},
+};
+
+static const struct spi_device_id pisound_spi_ids[] = {
+	{ "pisound-spi", 0 },
+	{},
+};
+
+MODULE_DEVICE_TABLE(of, pisound_spi_of_match);
+MODULE_DEVICE_TABLE(spi, pisound_spi_ids);
+
+static struct spi_driver pisnd_spi_driver = {
+	.driver = {
+		.name           = "pisound-spi",
+		.owner          = THIS_MODULE,
+		.of_match_table = pisound_spi_of_match,
+		.probe_type     = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.id_table           = pisound_spi_ids,
+	.probe              = pisnd_spi_probe,
+	.remove             = pisnd_spi_remove,
+};
+
 MODULE_DEVICE_TABLE(of, pisound_of_match);
 
 static struct platform_driver pisnd_driver = {
@@ -1229,12 +3338,34 @@ static struct platform_driver pisnd_driver = {
 		.name           = "snd-rpi-pisound",
 		.owner          = THIS_MODULE,
 		.of_match_table = pisound_of_match,
+		.probe_type     = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe              = pisnd_probe,
 	.remove             = pisnd_remove,
 };
 
-module_platform_driver(pisnd_driver);
+static int __init pisnd_module_init(void)
+{
+	int ret = spi_register_driver(&pisnd_spi_driver);
+
+	if (ret < 0)
+		return ret;
+
+	ret = platform_driver_register(&pisnd_driver);
+	if (ret < 0)
+		spi_unregister_driver(&pisnd_spi_driver);
+
+	return ret;
+}
+
+static void __exit pisnd_module_exit(void)
+{
+	platform_driver_unregister(&pisnd_driver);
+	spi_unregister_driver(&pisnd_spi_driver);
+}
+
+module_init(pisnd_module_init);
+module_exit(pisnd_module_exit);
 
 MODULE_AUTHOR("Giedrius Trainavicius <giedrius@blokas.io>");
 MODULE_DESCRIPTION("ASoC Driver for Pisound, https://blokas.io/pisound");
@@ -31,6 +31,7 @@ if [ -z $PISOUND_MIDI_DEVICE ]; then
 fi
 
 PISOUND_LED_FILE="/sys/kernel/pisound/led"
+PISOUND_LED_CLASS_DIR="/sys/class/leds/pisound::flash"
 
 # Takes an unsigned integer value, [0;255] for flash duration.
 if [ -e $PISOUND_LED_FILE ]; then
@@ -51,6 +52,9 @@ fi
 # A third optional argument can be provided - a temporary file for inner process id storage.
 # It allows starting multiple 'blink' processes in parallel, and controlling them individually.
 # Example value - /tmp/.example-blink-pid
+# If the LED class device and the pattern trigger are available, the blinking is done by the
+# kernel, and no process is left running. The LED has a single pattern, so stopping any blink
+# stops them all.
 periodic_led_blink() {
 	local PID_FILE
 	if [ "$#" -eq 3 ]; then
@@ -59,7 +63,19 @@ periodic_led_blink() {
 		PID_FILE=/tmp/.pisound-blink-pid
 	fi
 
-	if [ "$#" -eq 2 ] || [ "$#" -eq 3 ]; then
+	if grep -qw pattern $PISOUND_LED_CLASS_DIR/trigger 2> /dev/null && { [ "$#" -eq 2 ] || [ "$#" -eq 3 ]; }; then
+		if [ "$2" = "0" ]; then
+			if [ -e $PID_FILE ]; then
+				sudo sh -c "echo none > $PISOUND_LED_CLASS_DIR/trigger"
+				rm -f $PID_FILE
+			fi
+		else
+			local PERIOD_MS=`awk "BEGIN { printf \"%d\", $2 * 1000 }"`
+			# The hw_pattern steps are '<flash duration> <period ms>', repeated until stopped.
+			sudo sh -c "echo pattern > $PISOUND_LED_CLASS_DIR/trigger; echo -1 > $PISOUND_LED_CLASS_DIR/repeat; echo $1 $PERIOD_MS > $PISOUND_LED_CLASS_DIR/hw_pattern"
+			echo kernel > $PID_FILE
+		fi
+	elif [ "$#" -eq 2 ] || [ "$#" -eq 3 ]; then
 		if [ "$2" = "0" ]; then
 			if [ -e $PID_FILE ]; then
 				kill `cat $PID_FILE` 2>/dev/null